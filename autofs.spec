@@ -94,6 +94,7 @@ fi
 %config(noreplace,missingok) /etc/auto.smb
 %config(noreplace) /etc/sysconfig/autofs
 %{_sbindir}/automount
+%{_sbindir}/autofs-rpcprobe
 %dir %{_libdir}/autofs
 %{_libdir}/autofs/*
 %{_mandir}/*/*
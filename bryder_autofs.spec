@@ -188,6 +188,7 @@ exit 0
 %dir /misc
 %dir %{_libdir}/autofs
 %{_sbindir}/automount
+%{_sbindir}/autofs-rpcprobe
 %{_mandir}/*/*
 %{_libdir}/autofs/*
 
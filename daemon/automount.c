@@ -30,10 +30,15 @@
 #include <string.h>
 #include <syslog.h>
 #include <unistd.h>
+#include <limits.h>
+#include <stdint.h>
 #include <sys/ioctl.h>
+#include <sys/mount.h>
+#include <sys/prctl.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/poll.h>
 #include <linux/auto_fs4.h>
@@ -77,6 +82,7 @@ int kproto_sub_version = 0;	/* Kernel protocol version used */
 int dumpmap = 0;		/* cmdline arg to dump map contents */
 
 static int submount = 0;
+static pid_t prober_pid = 0;	/* Background server prober */
 
 int do_verbose = 0;		/* Verbose feedback option */
 int do_debug = 0;		/* Enable full debug output */
@@ -97,6 +103,8 @@ volatile struct pending_mount *junk_mounts = NULL;
 
 #define EXIT_CHECK_TIME		2000	/* Total time to wait before retry */
 #define EXIT_CHECK_DELAY	200	/* Time interval to check if exited */
+#define WALK_BUFSIZ		4096	/* getdents64 buffer per directory level */
+#define MKDIR_CACHE_SIZE	64	/* Slots in the created directory cache */
 
 static void cleanup_exit(const char *path, int exit_code);
 static int handle_packet_expire(const struct autofs_packet_expire *pkt);
@@ -128,11 +136,172 @@ static int do_mkdir(const char *path, mode_t mode)
 	return 0;
 }
 
+/*
+ * Directories under the autofs root known to exist, so building a
+ * deep path doesn't mkdir every prefix again, only checks nothing has
+ * been mounted on it. Direct mapped by hash of the root relative
+ * path, a collision just replaces the entry.
+ */
+static char *mkdir_cache[MKDIR_CACHE_SIZE];
+
+static unsigned int mkdir_hash(const char *rel, size_t len)
+{
+	unsigned int hash = 0;
+
+	while (len--)
+		hash = hash * 31 + (unsigned char) *rel++;
+
+	return hash % MKDIR_CACHE_SIZE;
+}
+
+static int mkdir_cached(const char *rel, size_t len)
+{
+	const char *ent = mkdir_cache[mkdir_hash(rel, len)];
+
+	return ent && strlen(ent) == len && !strncmp(ent, rel, len);
+}
+
+static void mkdir_cache_add(const char *rel, size_t len)
+{
+	char **slot = &mkdir_cache[mkdir_hash(rel, len)];
+	char *ent;
+
+	ent = malloc(len + 1);
+	if (!ent)
+		return;
+	memcpy(ent, rel, len);
+	ent[len] = '\0';
+
+	if (*slot)
+		free(*slot);
+	*slot = ent;
+}
+
+static void mkdir_cache_del(const char *rel, size_t len)
+{
+	char **slot = &mkdir_cache[mkdir_hash(rel, len)];
+
+	if (*slot && mkdir_cached(rel, len)) {
+		free(*slot);
+		*slot = NULL;
+	}
+}
+
+static void mkdir_cache_flush(void)
+{
+	int i;
+
+	for (i = 0; i < MKDIR_CACHE_SIZE; i++) {
+		if (mkdir_cache[i]) {
+			free(mkdir_cache[i]);
+			mkdir_cache[i] = NULL;
+		}
+	}
+}
+
+/* Path relative to the autofs root, or NULL if it isn't under it */
+static const char *root_relative(const char *path)
+{
+	size_t len;
+
+	if (ap.rootfd < 0 || !ap.path)
+		return NULL;
+
+	len = strlen(ap.path);
+	if (strncmp(path, ap.path, len) || path[len] != '/')
+		return NULL;
+
+	path += len;
+	while (*path == '/')
+		path++;
+
+	return *path ? path : NULL;
+}
+
+/*
+ * mkdir_path() for a path under the autofs root, relative to our fd
+ * on it. Returns 1 if the path leaves our filesystem part way down,
+ * that needs the contained_in_local_fs() checks of do_mkdir().
+ */
+static int mkdir_path_at(const char *rel, mode_t mode)
+{
+	char *buf = alloca(strlen(rel) + 1);
+	const char *cp;
+	struct stat st;
+	int flushed = 0;
+	size_t len;
+	int last;
+
+again:
+	for (cp = rel; ; cp++) {
+		if (*cp != '/' && *cp != '\0')
+			continue;
+
+		last = (*cp == '\0');
+		len = cp - rel;
+		if (cp[-1] == '/') {
+			if (last)
+				break;
+			continue;
+		}
+
+		memcpy(buf, rel, len);
+		buf[len] = '\0';
+
+		/* Unless something has been mounted on it since */
+		if (!last && mkdir_cached(rel, len)) {
+			if (fstatat(ap.rootfd, buf, &st, 0) == 0 &&
+			    S_ISDIR(st.st_mode) && st.st_dev == ap.dev)
+				continue;
+			mkdir_cache_del(rel, len);
+		}
+
+		if (mkdirat(ap.rootfd, buf, mode) == -1) {
+			if (errno == ENOENT && !flushed) {
+				/* Someone removed a directory we cached */
+				mkdir_cache_flush();
+				flushed = 1;
+				goto again;
+			}
+			if (errno != EEXIST)
+				return -1;
+
+			if (fstatat(ap.rootfd, buf, &st, 0) == -1)
+				return -1;
+			if (!S_ISDIR(st.st_mode)) {
+				errno = ENOTDIR;
+				return -1;
+			}
+			if (last)
+				break;
+			if (st.st_dev != ap.dev)
+				return 1;
+		}
+
+		if (last)
+			break;
+		mkdir_cache_add(rel, len);
+	}
+
+	return 0;
+}
+
 int mkdir_path(const char *path, mode_t mode)
 {
-	char *buf = alloca(strlen(path) + 1);
+	const char *rel = root_relative(path);
+	char *buf;
 	const char *cp = path, *lcp = path;
-	char *bp = buf;
+	char *bp;
+	int ret;
+
+	if (rel) {
+		ret = mkdir_path_at(rel, mode);
+		if (ret <= 0)
+			return ret;
+	}
+
+	buf = alloca(strlen(path) + 1);
+	bp = buf;
 
 	do {
 		if (cp != path && (*cp == '/' || *cp == '\0')) {
@@ -151,14 +320,50 @@ int mkdir_path(const char *path, mode_t mode)
 	return 0;
 }
 
+/*
+ * rmdir_path() for a path under the autofs root. Stops short of the
+ * root itself, which is ours and mounted on anyway.
+ */
+static int rmdir_path_at(const char *rel)
+{
+	int len = strlen(rel);
+	char *buf = alloca(len + 1);
+	char *cp;
+	int first = 1;
+
+	strcpy(buf, rel);
+	cp = buf + len;
+
+	do {
+		*cp = '\0';
+
+		mkdir_cache_del(buf, cp - buf);
+
+		/* Last element of path may be non-dir;
+		   all others are directories */
+		if (unlinkat(ap.rootfd, buf, AT_REMOVEDIR) == -1 &&
+		    (!first || unlinkat(ap.rootfd, buf, 0) == -1))
+			return -1;
+
+		first = 0;
+	} while ((cp = strrchr(buf, '/')) != NULL);
+
+	return 0;
+}
+
 /* Remove as much as possible of a path */
 int rmdir_path(const char *path)
 {
+	const char *rel = root_relative(path);
 	int len = strlen(path);
-	char *buf = alloca(len + 1);
+	char *buf;
 	char *cp;
 	int first = 1;
 
+	if (rel)
+		return rmdir_path_at(rel);
+
+	buf = alloca(len + 1);
 	strcpy(buf, path);
 	cp = buf + len;
 
@@ -176,83 +381,268 @@ int rmdir_path(const char *path)
 	return 0;
 }
 
-static int umount_ent(const char *root, const char *name, const char *type)
+/*
+ * Take down a mount we can't unmount cleanly, because its server is
+ * gone or umount(8) wedged. Lazy so nothing here waits on the server,
+ * forced so anything already stuck on it gets to fail.
+ */
+static int umount_detach(const char *path)
 {
-	char path_buf[PATH_MAX];
-	struct stat st;
-	int sav_errno;
-	int is_smbfs = (strcmp(type, "smbfs") == 0);
-	int status;
-	int rv = 0;
+	int rv;
 
-	sprintf(path_buf, "%s/%s", root, name);
-	status =  lstat(path_buf, &st);
-	sav_errno = errno;
+	if (!aquire_lock())
+		return 1;
 
-	/* EIO appears to correspond to an smb mount that has gone away */
-	if (!status ||
-	    (is_smbfs && (sav_errno == EIO || sav_errno == EBADSLT))) {
-		int umount_ok = 0;
+	rv = umount2(path, MNT_DETACH | MNT_FORCE);
+	if (rv == -1) {
+		error("umount_detach: can't detach %s: %m", path);
+		release_lock();
+		return 1;
+	}
+	remove_mtab_entry(path);
+	release_lock();
 
-		if (!status && (S_ISDIR(st.st_mode) && (st.st_dev != ap.dev)))
-			umount_ok = 1;
+	warn("umount_detach: detached %s", path);
 
-		if (umount_ok || is_smbfs) {
-			rv = spawnll(LOG_DEBUG, 
-				    PATH_UMOUNT, PATH_UMOUNT, path_buf, NULL);
-		}
+	return 0;
+}
+
+/*
+ * Only an NFS mount has a server we can ask about. It counts as dead
+ * once the server table has seen it fail probes SRV_DEAD_FAILS times
+ * running, never on one lost packet. Everything else gets umount(8)
+ * under its watchdog first.
+ */
+static int server_is_dead(const char *fs_name, const char *type)
+{
+	char host[HOST_NAME_MAX + 1];
+	const char *colon;
+	size_t len;
+
+	if (strcmp(type, "nfs") && strcmp(type, "nfs4"))
+		return 0;
+
+	colon = strchr(fs_name, ':');
+	if (!colon || (len = colon - fs_name) == 0 || len > HOST_NAME_MAX)
+		return 0;
+
+	memcpy(host, fs_name, len);
+	host[len] = '\0';
+
+	return server_dead(host);
+}
+
+/*
+ * The caller found path in the mount table, so it isn't looked at
+ * here: a stat of a dead server's mount would hang us.
+ */
+static int umount_ent(const char *path, const char *fs_name, const char *type)
+{
+	int rv;
+
+	if (server_is_dead(fs_name, type)) {
+		warn("umount_ent: server for %s not responding", path);
+		return umount_detach(path);
+	}
+
+	rv = spawnll(LOG_DEBUG, PATH_UMOUNT, PATH_UMOUNT, path, NULL);
+	if (rv == SPAWN_TIMEOUT) {
+		warn("umount_ent: umount of %s hung", path);
+		rv = umount_detach(path);
 	}
+
 	return rv;
 }
 
-/* Like ftw, except fn gets called twice: before a directory is
-   entered, and after.  If the before call returns 0, the directory
-   isn't entered. */
-static int walk_tree(const char *base, int (*fn) (const char *file,
-						  const struct stat * st,
-						  int, void *), int incl, void *arg)
+/*
+ * The mount points under a walk, hashed by path once for the walk so
+ * that each entry is looked for with a probe or two, not a pass over
+ * the whole mount list. Open addressing, at most half full.
+ */
+struct walk_mounts {
+	unsigned int size;		/* A power of two */
+	const char **path;
+};
+
+static unsigned int walk_hash(const char *path)
 {
-	char buf[PATH_MAX + 1];
+	unsigned int hash = 0;
+
+	while (*path)
+		hash = hash * 31 + (unsigned char) *path++;
+
+	return hash;
+}
+
+static int walk_mounts_init(struct walk_mounts *wm, struct mnt_list *mnts)
+{
+	struct mnt_list *m;
+	unsigned int count = 0, i;
+
+	for (m = mnts; m; m = m->next)
+		count++;
+
+	wm->size = 16;
+	while (wm->size < 2 * count)
+		wm->size <<= 1;
+
+	wm->path = calloc(wm->size, sizeof(char *));
+	if (!wm->path) {
+		error("walk_mounts_init: calloc: %m");
+		return -1;
+	}
+
+	for (m = mnts; m; m = m->next) {
+		i = walk_hash(m->path) & (wm->size - 1);
+		while (wm->path[i] && strcmp(wm->path[i], m->path))
+			i = (i + 1) & (wm->size - 1);
+		wm->path[i] = m->path;
+	}
+
+	return 0;
+}
+
+static int walk_mounted(const struct walk_mounts *wm, const char *path)
+{
+	unsigned int i = walk_hash(path) & (wm->size - 1);
+
+	for (; wm->path[i]; i = (i + 1) & (wm->size - 1))
+		if (!strcmp(wm->path[i], path))
+			return 1;
+
+	return 0;
+}
+
+/*
+ * lstat() that keeps off mount points. Anything in the mount table is
+ * reported as a directory on some other device without asking the
+ * filesystem, which is all the walkers want to know.
+ */
+static int walk_lstat(int dfd, const char *name, const char *path,
+		      const struct walk_mounts *mnts, struct stat *st)
+{
+	if (walk_mounted(mnts, path)) {
+		memset(st, 0, sizeof(*st));
+		st->st_mode = S_IFDIR;
+		st->st_dev = ~ap.dev;
+		return 0;
+	}
+	return fstatat(dfd, name, st, AT_SYMLINK_NOFOLLOW);
+}
+
+/* Directory entry as returned by getdents64() */
+struct walk_dirent {
+	uint64_t	d_ino;
+	int64_t		d_off;
+	unsigned short	d_reclen;
+	unsigned char	d_type;
+	char		d_name[];
+};
+
+typedef int (*walk_fn) (int dfd, const char *name, const char *path,
+			const struct stat *st, int when, void *arg);
+
+/*
+ * Walk the directory open on fd. Entries are handled in the order the
+ * filesystem hands them back, each with one fstatat() relative to its
+ * parent. path holds the name of the directory, len its length, and
+ * gets each entry name appended in turn for the callbacks to log.
+ */
+static int walk_dir(int fd, char *path, size_t len,
+		    walk_fn fn, const struct walk_mounts *mnts, void *arg)
+{
+	long buf[WALK_BUFSIZ / sizeof(long)];
+	struct walk_dirent *de;
 	struct stat st;
+	int n, off;
 
-	if (lstat(base, &st) != -1 && (fn) (base, &st, 0, arg)) {
-		if (S_ISDIR(st.st_mode)) {
-			struct dirent **de;
-			int n;
+	while ((n = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+		for (off = 0; off < n; off += de->d_reclen) {
+			size_t nlen;
+			int sub;
 
-			n = scandir(base, &de, 0, alphasort);
-			if (n < 0)
-				return -1;
+			de = (struct walk_dirent *) ((char *) buf + off);
 
-			while (n--) {
-				int ret, size;
+			if (de->d_name[0] == '.' && (de->d_name[1] == '\0' ||
+			    (de->d_name[1] == '.' && de->d_name[2] == '\0')))
+				continue;
 
-				if (strcmp(de[n]->d_name, ".") == 0 ||
-				    strcmp(de[n]->d_name, "..") == 0)
-					continue;
+			nlen = strlen(de->d_name);
+			if (len + nlen + 1 > PATH_MAX)
+				continue;
+			path[len] = '/';
+			memcpy(path + len + 1, de->d_name, nlen + 1);
 
-				size = sizeof(buf);
-				ret = cat_path(buf, size, base, de[n]->d_name);
-				if (!ret) {
-					do {
-						free(de[n]);
-					} while (n--);
-					free(de);
-					return -1;
+			if (walk_lstat(fd, de->d_name, path, mnts, &st) == -1)
+				continue;
+
+			if (!(fn) (fd, de->d_name, path, &st, 0, arg))
+				continue;
+
+			if (S_ISDIR(st.st_mode)) {
+				sub = openat(fd, de->d_name,
+					     O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+				if (sub >= 0) {
+					walk_dir(sub, path, len + 1 + nlen,
+						 fn, mnts, arg);
+					close(sub);
 				}
+			}
+
+			(fn) (fd, de->d_name, path, &st, 1, arg);
+		}
+	}
+	path[len] = '\0';
 
-				walk_tree(buf, fn, 1, arg);
-				free(de[n]);
+	return n;
+}
+
+/* Like ftw, except fn gets called twice: before a directory is
+   entered, and after.  If the before call returns 0, the directory
+   isn't entered.  Paths in mnts are mount points and never stat()ed.
+   fn gets the entry as a name relative to the directory fd dfd. */
+static int walk_tree(const char *base, walk_fn fn, int incl,
+		     struct mnt_list *mnts, void *arg)
+{
+	char path[PATH_MAX + 1];
+	struct walk_mounts wm;
+	struct stat st;
+	size_t len;
+	int fd, ret = 0;
+
+	len = strlen(base);
+	if (len > PATH_MAX)
+		return -1;
+	memcpy(path, base, len + 1);
+
+	if (walk_mounts_init(&wm, mnts))
+		return -1;
+
+	if (walk_lstat(AT_FDCWD, base, path, &wm, &st) != -1 &&
+	    (fn) (AT_FDCWD, base, base, &st, 0, arg)) {
+		if (S_ISDIR(st.st_mode)) {
+			fd = open(base, O_RDONLY|O_DIRECTORY|O_NOFOLLOW);
+			if (fd < 0) {
+				ret = -1;
+				goto out;
 			}
-			free(de);
+
+			if (walk_dir(fd, path, len, fn, &wm, arg) < 0)
+				ret = -1;
+			close(fd);
+			if (ret)
+				goto out;
 		}
 		if (incl)
-			(fn) (base, &st, 1, arg);
+			(fn) (AT_FDCWD, base, base, &st, 1, arg);
 	}
-	return 0;
+out:
+	free(wm.path);
+	return ret;
 }
 
-static int rm_unwanted_fn(const char *file, const struct stat *st, int when, void *arg)
+static int rm_unwanted_fn(int dfd, const char *name, const char *file,
+			  const struct stat *st, int when, void *arg)
 {
 	int rmsymlink = *(int *) arg;
 	struct stat newst;
@@ -263,7 +653,7 @@ static int rm_unwanted_fn(const char *file, const struct stat *st, int when, voi
 		return 1;
 	}
 	info("rm_unwanted_fn: want to remove %s\n", file);
-	if (lstat(file, &newst)) {
+	if (fstatat(dfd, name, &newst, AT_SYMLINK_NOFOLLOW)) {
 		crit ("rm_unwanted_fn: unable to stat file, possible race "
 		      "condition.");
 		return 0;
@@ -276,7 +666,7 @@ static int rm_unwanted_fn(const char *file, const struct stat *st, int when, voi
 	}
 
 	if (S_ISDIR(newst.st_mode)) {
-		if (rmdir(file)) {
+		if (unlinkat(dfd, name, AT_REMOVEDIR)) {
 			info ("rm_unwanted_fn: unable to remove directory"
 			      " %s", file);
 			return 0;
@@ -289,7 +679,7 @@ static int rm_unwanted_fn(const char *file, const struct stat *st, int when, voi
 		return 0;
 	} else if (S_ISLNK(newst.st_mode) && rmsymlink) {
 	        info ("rm_unwanted_fn: removing symlink %s",file);
-		unlink(file);
+		unlinkat(dfd, name, 0);
 	}
 
 	return 1;
@@ -297,7 +687,11 @@ static int rm_unwanted_fn(const char *file, const struct stat *st, int when, voi
 
 static void rm_unwanted(const char *path, int incl, int rmsymlink)
 {
-	walk_tree(path, rm_unwanted_fn, incl, &rmsymlink);
+	struct mnt_list *mnts = get_mnt_list(PROC_MOUNTS, path, 0);
+
+	mkdir_cache_flush();
+	walk_tree(path, rm_unwanted_fn, incl, mnts, &rmsymlink);
+	free_mnt_list(mnts);
 }
 
 static void check_rm_dirs(const char *path, int incl)
@@ -331,7 +725,7 @@ static int umount_multi(const char *path, int incl)
 	left = 0;
 	for (mptr = mntlist; mptr != NULL; mptr = mptr->next) {
 		debug("umount_multi: unmounting dir=%s\n", mptr->path);
-		if (umount_ent("", mptr->path, mptr->fs_type)) {
+		if (umount_ent(mptr->path, mptr->fs_name, mptr->fs_type)) {
 			left++;
 		}
 	}
@@ -373,10 +767,11 @@ static int do_umount_autofs(void)
 	}
 	if (ap.pipefd >= 0)
 		close(ap.pipefd);
+	if (ap.rootfd >= 0) {
+		close(ap.rootfd);
+		ap.rootfd = -1;
+	}
 	for (i = 0; i < retries; i++) {
-		struct stat st;
-		int ret;
-
 		rv = spawnll(LOG_DEBUG,
 			    PATH_UMOUNT, PATH_UMOUNT, ap.path, NULL);
 		if (rv & MTAB_NOTUPDATED) {
@@ -386,9 +781,12 @@ static int do_umount_autofs(void)
 			rv = spawnll(LOG_DEBUG,
 				    PATH_UMOUNT, PATH_UMOUNT, ap.path, NULL);
 		}
-		ret = stat(ap.path, &st);
-		if (rv == 0 || (ret == -1 && errno == ENOENT) ||
-		    (ret == 0 && (!S_ISDIR(st.st_mode) || st.st_dev != ap.dev))) {
+		if (rv == SPAWN_TIMEOUT) {
+			warn("umount %s hung: detaching\n", ap.path);
+			rv = umount_detach(ap.path);
+			break;
+		}
+		if (rv == 0 || !is_mounted(PROC_MOUNTS, ap.path)) {
 			rv = 0;
 			break;
 		}
@@ -449,7 +847,7 @@ static int mount_autofs(char *path)
 		errno = ENOMEM;
 		return -1;
 	}
-	ap.pipefd = ap.ioctlfd = -1;
+	ap.pipefd = ap.ioctlfd = ap.rootfd = -1;
 
 	/* In case the directory doesn't exist, try to mkdir it */
 	if (mkdir_path(path, 0555) < 0) {
@@ -536,6 +934,11 @@ static int mount_autofs(char *path)
 	stat(path, &st);
 	ap.dev = st.st_dev;	/* Device number for mount point checks */
 
+	/* Anchor for mkdir_path() and rmdir_path() under the root */
+	ap.rootfd = open(path, O_RDONLY | O_DIRECTORY);
+	if (ap.rootfd >= 0)
+		fcntl(ap.rootfd, F_SETFD, FD_CLOEXEC);
+
 	ap.mounts = NULL;	/* No pending mounts */
 	ap.state = ST_READY;
 
@@ -760,7 +1163,8 @@ static int st_ready(void)
 	return 0;
 }
 
-static int counter_fn(const char *file, const struct stat *st, int when, void *arg)
+static int counter_fn(int dfd, const char *name, const char *file,
+		      const struct stat *st, int when, void *arg)
 {
 	int *countp = (int *) arg;
 
@@ -775,12 +1179,14 @@ static int counter_fn(const char *file, const struct stat *st, int when, void *a
 /* Count mounted filesystems and symlinks */
 static int count_mounts(const char *path)
 {
+	struct mnt_list *mnts = get_mnt_list(PROC_MOUNTS, path, 0);
 	int count = 0;
+	int ret;
 
-	if (walk_tree(path, counter_fn, 0, &count) == -1)
-		return -1;
+	ret = walk_tree(path, counter_fn, 0, mnts, &count);
+	free_mnt_list(mnts);
 
-	return count;
+	return ret == -1 ? -1 : count;
 }
 
 enum expire {
@@ -1015,15 +1421,17 @@ static int fullread(int fd, void *ptr, size_t len)
 static int get_pkt(int fd, union autofs_packet_union *pkt)
 {
 	sigset_t old;
-	struct pollfd fds[2];
+	struct pollfd fds[3];
 
 	fds[0].fd = fd;
 	fds[0].events = POLLIN;
 	fds[1].fd = ap.state_pipe[0];
 	fds[1].events = POLLIN;
+	fds[2].fd = ap.netlinkfd;
+	fds[2].events = POLLIN;
 
 	for (;;) {
-		if (poll(fds, 2, -1) == -1) {
+		if (poll(fds, 3, -1) == -1) {
 			if (errno == EINTR)
 				continue;
 			syslog(LOG_ERR, "get_pkt: poll failed: %m");
@@ -1086,6 +1494,9 @@ static int get_pkt(int fd, union autofs_packet_union *pkt)
 				return -1;
 		}
 
+		if (fds[2].revents & POLLIN)
+			local_addr_changed(ap.netlinkfd);
+
 		if (fds[0].revents & POLLIN)
 			return fullread(fd, pkt, sizeof(*pkt));
 	}
@@ -1466,6 +1877,9 @@ static void become_daemon(void)
 
 static void cleanup_exit(const char *path, int exit_code)
 {
+	if (prober_pid > 0)
+		kill(prober_pid, SIGTERM);
+
 	if (ap.lookup)
 		close_lookup(ap.lookup);
 
@@ -1501,9 +1915,12 @@ static void usage(void)
 	fprintf(stderr, "Usage: %s [options] path map_type [args...]\n", program);
 	fprintf(stderr, "   -D|--dumpmap dumps out the maps read and exits\n");
 	fprintf(stderr, "   -r|--random-multimount-selection  randomly selects a multimount server rather than testing each one for performance\n");
+	fprintf(stderr, "   -H|--hash-multimount-selection  always selects the same multimount server for this host and mount, while it is up, without testing any\n");
 	fprintf(stderr, "   -u|--use-old-ldap-lookup instead of figuring out the schema once do it every single time a mount is requested. This is the old behaviour\n");
  	fprintf(stderr, "   -I|--ignore-stupid-paths will never lookup a requested path which contains the * character or which starts with a dot (.) \n");
- 	fprintf(stderr, "   -R|--max-nfs-mount-retries <n> and -P|--nfs-mount-retry-pause <max secs> retres nfs mounts when certain error messages are seen. Default is no retry. pause is max seconds to wait (the pause is random from 1 to (pause+1) seconds\n");
+ 	fprintf(stderr, "   -R|--max-nfs-mount-retries <n> and -P|--nfs-mount-retry-pause <max secs> retres nfs mounts when certain error messages are seen. Default is no retry. pause is max seconds to wait, less 1 (the pause backs off per server from 1 to (pause+1) seconds, 0 retries without one)\n");
+ 	fprintf(stderr, "   -M|--mount-timeout, -U|--umount-timeout and -F|--fsck-timeout <secs> kill a mount, umount or fsck that runs longer than this. 0 waits forever. Defaults are %d, %d and %d\n", DEFAULT_MOUNT_TIMEOUT, DEFAULT_UMOUNT_TIMEOUT, DEFAULT_FSCK_TIMEOUT);
+ 	fprintf(stderr, "   -S|--probe-interval <secs> probes the NFS servers in use in the background every <secs> seconds. Default is off\n");
 }
 
 static void setup_signals(__sighandler_t event_handler, __sighandler_t cld_handler)
@@ -1670,12 +2087,54 @@ int supervisor(char *path)
 	return 0;
 }
 
+/*
+ * Keep the server table fresh from a child of our own. It is started
+ * before the autofs mount so it holds nothing open on it.
+ */
+static void start_prober(void)
+{
+	pid_t f;
+
+	f = fork();
+	if (f < 0) {
+		error("start_prober: fork: %m");
+		return;
+	} else if (f > 0) {
+		prober_pid = f;
+		return;
+	}
+
+	ignore_signals();
+	signal(SIGTERM, SIG_DFL);
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+	server_prober(ap.probe_interval);
+	exit(0);
+}
+
+/* Before waiting for the rest of our children, it never exits itself */
+static void stop_prober(void)
+{
+	if (prober_pid <= 0)
+		return;
+
+	kill(prober_pid, SIGTERM);
+	waitpid(prober_pid, NULL, 0);
+	prober_pid = 0;
+}
+
 int handle_mounts(char *path)
 {
 	unsigned int map = 0;
 
 	setup_signals(sig_statemachine, sig_child);
 
+	if (ap.probe_interval && !submount)
+		start_prober();
+
+	/* Children inherit the set, so only we keep it current */
+	ap.netlinkfd = local_addr_init();
+
 	if (mount_autofs(path) < 0) {
 		crit("%s: mount failed!", path);
 		cleanup_exit(path, 1);
@@ -1775,6 +2234,11 @@ int handle_mounts(char *path)
 	}
 	debug("Shutting down - ap.state is %d if it's not %d (ST_SHUTDOWN) something bad happened ",ap.state,ST_SHUTDOWN);
 
+	/* Lookup modules may keep children of their own, stop them first */
+	close_lookup(ap.lookup);
+	ap.lookup = NULL;
+	stop_prober();
+
 	/* Mop up remaining kids */
 	handle_child(1);
 
@@ -1800,10 +2264,15 @@ int main(int argc, char *argv[])
 		{"submount", 0, &submount, 1},
 		{"dumpmap", 0, 0, 'D'},
 		{"random-multimount-selection", 0, 0, 'r'},
+		{"hash-multimount-selection", 0, 0, 'H'},
 		{"use-old-ldap-lookup", 0, 0, 'u'},
 		{"ignore-stupid-paths", 0, 0, 'I'},
 		{"max-nfs-mount-retries", 1, 0, 'R'},
 		{"nfs-mount-retry-pause", 1, 0, 'P'}, /* This is in fact the maximum pause - 1s (ie the code will randomly sleep between 1 and retry-pause +1 seconds) */
+		{"mount-timeout", 1, 0, 'M'},
+		{"umount-timeout", 1, 0, 'U'},
+		{"fsck-timeout", 1, 0, 'F'},
+		{"probe-interval", 1, 0, 'S'},
 		{0, 0, 0, 0}
 	};
 
@@ -1814,10 +2283,13 @@ int main(int argc, char *argv[])
 	ap.ghost = DEFAULT_GHOST_MODE;
 	ap.type = LKP_INDIRECT;
 	ap.dir_created = 0; /* We haven't created the main directory yet */
- 
+	ap.mount_timeout = DEFAULT_MOUNT_TIMEOUT;
+	ap.umount_timeout = DEFAULT_UMOUNT_TIMEOUT;
+	ap.fsck_timeout = DEFAULT_FSCK_TIMEOUT;
+	ap.nfs_mount_retry_pause = 1;	/* -P 0 retries without a pause */
 
 	opterr = 0;
-	while ((opt = getopt_long(argc, argv, "+hp:t:vdVgDruIR:P:", long_options, NULL)) != EOF) {
+	while ((opt = getopt_long(argc, argv, "+hp:t:vdVgDrHuIR:P:M:U:F:S:", long_options, NULL)) != EOF) {
 		switch (opt) {
 		case 'h':
 			usage();
@@ -1853,6 +2325,9 @@ int main(int argc, char *argv[])
 		case 'r':
 			ap.random_multimount = 1;
 			break;
+		case 'H':
+			ap.hash_multimount = 1;
+			break;
 		case 'u':
 			ap.use_old_ldap_lookup = 1;
 			break;
@@ -1868,16 +2343,28 @@ int main(int argc, char *argv[])
 			ap.nfs_mount_retry_pause =  getnumopt(optarg, opt);
 			break;
 
+		case 'M':
+			ap.mount_timeout = getnumopt(optarg, opt);
+			break;
+
+		case 'U':
+			ap.umount_timeout = getnumopt(optarg, opt);
+			break;
+
+		case 'F':
+			ap.fsck_timeout = getnumopt(optarg, opt);
+			break;
+
+		case 'S':
+			ap.probe_interval = getnumopt(optarg, opt);
+			break;
+
 		case '?':
 		case ':':
 			printf("%s: Ambiguous or unknown options\n", program);
 			exit(1);
 		}
 	}
-	/* Set this to a sane value even if it isn't used */
-	if (ap.nfs_mount_retry_pause <= 0){
-		ap.nfs_mount_retry_pause = 1;
-	}
 	if (geteuid() != 0) {
 		fprintf(stderr, "%s: This program must be run by root.\n", program);
 		exit(1);
@@ -0,0 +1,383 @@
+#ident "$Id$"
+/* ----------------------------------------------------------------------- *
+ *
+ *  rpcprobe.c - NFS server latency sweep
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, Inc., 675 Mass Ave, Cambridge MA 02139,
+ *   USA; either version 2 of the License, or (at your option) any later
+ *   version; incorporated herein by reference.
+ *
+ *   Every server, given by name or found in file maps, is probed with
+ *   every NFS version and transport at once, some number of rounds,
+ *   through the same code the daemon chooses servers with. Round trips
+ *   of the NULL calls and of the portmapper GETPORTs before them are
+ *   reported as percentiles, with how often each one failed.
+ *
+ * ----------------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include <limits.h>
+#include <syslog.h>
+#include <math.h>
+#include <sys/time.h>
+#include <linux/nfs2.h>
+#include <linux/nfs3.h>
+#include <netinet/in.h>
+
+#include "automount.h"
+
+#define DEFAULT_COUNT		10
+#define DEFAULT_INTERVAL	1000	/* ms between rounds */
+#define DEFAULT_PROBE_TOUT	2000	/* ms to wait for each round */
+
+#define MAP_LINE_MAX		4096
+
+int do_verbose = 0;
+int do_debug = 0;
+
+static char *program;
+
+static const struct {
+	unsigned int status;
+	const char *name;
+} combos[] = {
+	{ RPC_PING_V3 | RPC_PING_UDP, "v3/udp" },
+	{ RPC_PING_V2 | RPC_PING_UDP, "v2/udp" },
+	{ RPC_PING_V3 | RPC_PING_TCP, "v3/tcp" },
+	{ RPC_PING_V2 | RPC_PING_TCP, "v2/tcp" },
+	{ RPC_PING_V4 | RPC_PING_TCP, "v4/tcp" },
+};
+
+#define COMBOS	(sizeof(combos) / sizeof(combos[0]))
+
+/* What came back for one host and combination over the rounds */
+struct result {
+	int sent;
+	int ok;
+	double *rtt;
+	int npmap;
+	double *pmap;
+};
+
+static char **hosts = NULL;
+static int nhosts = 0;
+
+static void add_host(const char *host)
+{
+	char **tmp;
+	int i;
+
+	for (i = 0; i < nhosts; i++) {
+		if (!strcmp(hosts[i], host))
+			return;
+	}
+
+	tmp = realloc(hosts, (nhosts + 1) * sizeof(char *));
+	if (!tmp || !(tmp[nhosts] = strdup(host))) {
+		fprintf(stderr, "%s: out of memory\n", program);
+		exit(1);
+	}
+	hosts = tmp;
+	nhosts++;
+}
+
+/*
+ * Pick the servers out of a location, "host1,host2(5):/path". Local
+ * paths and entries that depend on the key are left out.
+ */
+static void add_location(char *loc)
+{
+	char *colon, *host, *save;
+
+	if (*loc == '-' || *loc == '/' || *loc == '"')
+		return;
+
+	colon = strchr(loc, ':');
+	if (!colon || colon == loc)
+		return;
+	*colon = '\0';
+
+	if (strpbrk(loc, "&$"))
+		return;
+
+	for (host = strtok_r(loc, ",", &save);
+	     host; host = strtok_r(NULL, ",", &save)) {
+		char *weight = strchr(host, '(');
+
+		if (weight)
+			*weight = '\0';
+		if (*host)
+			add_host(host);
+	}
+}
+
+/* Every server named in a file map */
+static int read_map(const char *file)
+{
+	char buf[MAP_LINE_MAX];
+	int cont = 0;
+	FILE *f;
+
+	f = fopen(file, "r");
+	if (!f) {
+		fprintf(stderr, "%s: can't open map %s: %m\n", program, file);
+		return 0;
+	}
+
+	while (fgets(buf, sizeof(buf), f)) {
+		char *tok, *save;
+		int len = strlen(buf);
+		int first = !cont;
+
+		while (len && (buf[len - 1] == '\n' || buf[len - 1] == ' ' ||
+			       buf[len - 1] == '\t'))
+			buf[--len] = '\0';
+		cont = len && buf[len - 1] == '\\';
+		if (cont)
+			buf[--len] = '\0';
+
+		tok = buf + strspn(buf, " \t");
+		if (first && (*tok == '#' || *tok == '+'))
+			continue;
+
+		for (tok = strtok_r(buf, " \t", &save);
+		     tok; tok = strtok_r(NULL, " \t", &save)) {
+			/* The key */
+			if (first) {
+				first = 0;
+				continue;
+			}
+			add_location(tok);
+		}
+	}
+
+	fclose(f);
+	return 1;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Nearest rank percentile of sorted samples, in ms */
+static double percentile(const double *samples, int n, int pct)
+{
+	int rank = (int) ceil(pct / 100.0 * n);
+
+	if (rank < 1)
+		rank = 1;
+	return samples[rank - 1] * 1000;
+}
+
+static void report(const char *host, const char *combo,
+		   int sent, double *rtt, int ok, double *pmap, int npmap)
+{
+	printf("%-24s %-7s %5d %6.1f", host, combo,
+	       sent, sent ? 100.0 * (sent - ok) / sent : 0.0);
+
+	if (ok) {
+		qsort(rtt, ok, sizeof(double), cmp_double);
+		printf(" %8.2f %8.2f %8.2f %8.2f %8.2f",
+		       rtt[0] * 1000, percentile(rtt, ok, 50),
+		       percentile(rtt, ok, 90), percentile(rtt, ok, 99),
+		       rtt[ok - 1] * 1000);
+	} else
+		printf(" %8s %8s %8s %8s %8s", "-", "-", "-", "-", "-");
+
+	if (npmap) {
+		qsort(pmap, npmap, sizeof(double), cmp_double);
+		printf(" %8.2f %8.2f\n",
+		       percentile(pmap, npmap, 50), percentile(pmap, npmap, 90));
+	} else
+		printf(" %8s %8s\n", "-", "-");
+}
+
+static void usage(void)
+{
+	fprintf(stderr, "Usage: %s [options] [server...]\n", program);
+	fprintf(stderr, "   -m|--map <file> probes the servers in a file map as well, may be given more than once\n");
+	fprintf(stderr, "   -c|--count <n> rounds of probes. Default is %d\n", DEFAULT_COUNT);
+	fprintf(stderr, "   -i|--interval <msecs> between the start of rounds. Default is %d\n", DEFAULT_INTERVAL);
+	fprintf(stderr, "   -t|--timeout <msecs> to wait for answers in each round. Default is %d\n", DEFAULT_PROBE_TOUT);
+	fprintf(stderr, "   -d|--debug logs what the probes do to stderr\n");
+}
+
+static long getnumopt(char *str, char option)
+{
+	char *end;
+	long val;
+
+	val = strtol(str, &end, 10);
+	if (!*str || *end || val < 0) {
+		fprintf(stderr, "%s: option -%c requires a number\n",
+			program, option);
+		exit(1);
+	}
+	return val;
+}
+
+int main(int argc, char *argv[])
+{
+	struct rpc_probe *probes;
+	struct result *res;
+	long count = DEFAULT_COUNT;
+	long interval = DEFAULT_INTERVAL;
+	long timeout = DEFAULT_PROBE_TOUT;
+	int nprobes, round, opt, i, c;
+
+	static const struct option long_options[] = {
+		{"help", 0, 0, 'h'},
+		{"map", 1, 0, 'm'},
+		{"count", 1, 0, 'c'},
+		{"interval", 1, 0, 'i'},
+		{"timeout", 1, 0, 't'},
+		{"debug", 0, 0, 'd'},
+		{0, 0, 0, 0}
+	};
+
+	program = argv[0];
+
+	while ((opt = getopt_long(argc, argv, "hm:c:i:t:d", long_options, NULL)) != EOF) {
+		switch (opt) {
+		case 'h':
+			usage();
+			exit(0);
+
+		case 'm':
+			if (!read_map(optarg))
+				exit(1);
+			break;
+
+		case 'c':
+			count = getnumopt(optarg, opt);
+			break;
+
+		case 'i':
+			interval = getnumopt(optarg, opt);
+			break;
+
+		case 't':
+			timeout = getnumopt(optarg, opt);
+			break;
+
+		case 'd':
+			do_debug = 1;
+			break;
+
+		default:
+			usage();
+			exit(1);
+		}
+	}
+
+	for (i = optind; i < argc; i++)
+		add_host(argv[i]);
+
+	if (!nhosts || !count || !timeout) {
+		usage();
+		exit(1);
+	}
+
+	openlog("autofs-rpcprobe", LOG_PERROR, LOG_DAEMON);
+	setlogmask(LOG_UPTO(do_debug ? LOG_DEBUG : LOG_WARNING));
+
+	nprobes = nhosts * COMBOS;
+	probes = calloc(nprobes, sizeof(struct rpc_probe));
+	res = calloc(nprobes, sizeof(struct result));
+	if (!probes || !res) {
+		fprintf(stderr, "%s: out of memory\n", program);
+		exit(1);
+	}
+	for (i = 0; i < nprobes; i++) {
+		res[i].rtt = calloc(count, sizeof(double));
+		res[i].pmap = calloc(count, sizeof(double));
+		if (!res[i].rtt || !res[i].pmap) {
+			fprintf(stderr, "%s: out of memory\n", program);
+			exit(1);
+		}
+	}
+
+	for (round = 0; round < count; round++) {
+		struct timeval start, end;
+		long taken;
+
+		gettimeofday(&start, NULL);
+
+		for (i = 0; i < nprobes; i++) {
+			probes[i].host = hosts[i / COMBOS];
+			probes[i].weight = INT_MAX;
+			probes[i].status = combos[i % COMBOS].status;
+		}
+
+		rpc_sweep(probes, nprobes, timeout);
+
+		for (i = 0; i < nprobes; i++) {
+			struct result *r = &res[i];
+
+			r->sent++;
+			if (probes[i].status)
+				r->rtt[r->ok++] = probes[i].time;
+			if (probes[i].pmap_time)
+				r->pmap[r->npmap++] = probes[i].pmap_time;
+		}
+
+		gettimeofday(&end, NULL);
+		taken = (end.tv_sec - start.tv_sec) * 1000 +
+			(end.tv_usec - start.tv_usec) / 1000;
+		if (round < count - 1 && taken < interval)
+			usleep((interval - taken) * 1000);
+	}
+
+	printf("%-24s %-7s %5s %6s %8s %8s %8s %8s %8s %8s %8s\n",
+	       "server", "proto", "sent", "fail%", "min", "p50", "p90",
+	       "p99", "max", "pmap p50", "pmap p90");
+
+	for (i = 0; i < nprobes; i++) {
+		struct result *r = &res[i];
+
+		report(hosts[i / COMBOS], combos[i % COMBOS].name,
+		       r->sent, r->rtt, r->ok, r->pmap, r->npmap);
+	}
+
+	/* And over all the servers */
+	if (nhosts > 1) {
+		for (c = 0; c < COMBOS; c++) {
+			double *rtt, *pmap;
+			int sent = 0, ok = 0, npmap = 0;
+
+			rtt = calloc(nhosts * count, sizeof(double));
+			pmap = calloc(nhosts * count, sizeof(double));
+			if (!rtt || !pmap) {
+				fprintf(stderr, "%s: out of memory\n", program);
+				exit(1);
+			}
+
+			for (i = c; i < nprobes; i += COMBOS) {
+				struct result *r = &res[i];
+
+				sent += r->sent;
+				memcpy(rtt + ok, r->rtt, r->ok * sizeof(double));
+				ok += r->ok;
+				memcpy(pmap + npmap, r->pmap,
+				       r->npmap * sizeof(double));
+				npmap += r->npmap;
+			}
+
+			report("(all)", combos[c].name,
+			       sent, rtt, ok, pmap, npmap);
+			free(rtt);
+			free(pmap);
+		}
+	}
+
+	exit(0);
+}
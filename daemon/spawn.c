@@ -27,6 +27,8 @@
 #include <time.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/poll.h>
 
 #include "automount.h"
 
@@ -253,6 +255,99 @@ char *retry_error_p(char *error_mesg) /* _p means predicate - is it's a test - o
 	  
 } /* retry_error_p */
 
+/*
+ * Same again for mounts made with the vers=, proto= and port= hints
+ * mount_nfs.c adds: errors that say those are out of date, so that it
+ * is worth trying once more without them. Not a refused connection,
+ * that is a server down far more often than a stale port, and is
+ * retried as such.
+ */
+int found_hint_error = 0;
+
+static char *hint_errors[] = {
+	"requested NFS version or transport protocol is not supported",
+	"Protocol not supported",
+	"Program not registered",
+	"Program/version mismatch",
+};
+
+static int hint_error_p(char *error_mesg)
+{
+	int i;
+
+	for (i = 0; i < (sizeof(hint_errors)/sizeof(char *)) ; i++){
+		if (strstr(error_mesg, hint_errors[i]) != NULL){
+			debug("spawn.c:%s: Found a hint error %s", __func__, hint_errors[i]);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+#define SPAWN_KILL_GRACE	5000	/* msecs from SIGTERM to SIGKILL */
+#define SPAWN_REAP_MAXNAP	100	/* msecs, max nap while reaping */
+
+static long long spawn_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (long long) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/*
+ * Deadline, in seconds, for a spawned helper. Anything we don't
+ * know about is allowed to run to completion.
+ */
+static time_t spawn_timeout(const char *prog)
+{
+	if (!strcmp(prog, PATH_MOUNT))
+		return ap.mount_timeout;
+
+	if (!strcmp(prog, PATH_UMOUNT))
+		return ap.umount_timeout;
+
+#ifdef HAVE_E2FSCK
+	if (!strcmp(prog, PATH_E2FSCK))
+		return ap.fsck_timeout;
+#endif
+#ifdef HAVE_E3FSCK
+	if (!strcmp(prog, PATH_E3FSCK))
+		return ap.fsck_timeout;
+#endif
+	return 0;
+}
+
+/*
+ * The helper has outlived its deadline. First ask it to go away
+ * with SIGTERM, then insist with SIGKILL. Returns the new deadline
+ * or 0 once we have run out of ways to get rid of it.
+ */
+static long long spawn_escalate(pid_t f, const char *prog, int *stage)
+{
+	switch ((*stage)++) {
+	case 0:
+		error("%s: %s (pid %d) timed out, sending SIGTERM",
+		      __func__, prog, f);
+		kill(f, SIGTERM);
+		break;
+
+	case 1:
+		error("%s: %s (pid %d) ignored SIGTERM, sending SIGKILL",
+		      __func__, prog, f);
+		kill(f, SIGKILL);
+		break;
+
+	default:
+		crit("%s: %s (pid %d) can't be killed, abandoning it",
+		     __func__, prog, f);
+		return 0;
+	}
+
+	return spawn_now() + SPAWN_KILL_GRACE;
+}
+
 static int do_spawn(int logpri, int use_lock, const char *prog, const char *const *argv)
 {
 	pid_t f;
@@ -260,6 +355,9 @@ static int do_spawn(int logpri, int use_lock, const char *prog, const char *cons
 	char errbuf[ERRBUFSIZ + 1], *p, *sp;
 	int errp, errn;
 	sigset_t allsignals, tmpsig, oldsig;
+	time_t timeout = spawn_timeout(prog);
+	long long deadline = 0;
+	int stage = 0, reaped = 0;
 
 	if (use_lock)
 		if (!aquire_lock())
@@ -304,10 +402,56 @@ static int do_spawn(int logpri, int use_lock, const char *prog, const char *cons
 			return -1;
 		}
 
+		if (timeout)
+			deadline = spawn_now() + (long long) timeout * 1000;
+
 		found_retryable_error = 0;
+		found_hint_error = 0;
 
 		errp = 0;
 		do {
+			struct pollfd pfd;
+			int wait = -1;
+
+			if (deadline) {
+				long long left = deadline - spawn_now();
+				wait = left > 0 ? (int) left : 0;
+			}
+
+			/*
+			 * Once signalled the helper may die while a
+			 * grandchild still holds the pipe open, so
+			 * keep an eye on it rather than wait for EOF.
+			 */
+			if (stage) {
+				if (waitpid(f, &status, WNOHANG) == f) {
+					reaped = 1;
+					break;
+				}
+				if (wait > SPAWN_REAP_MAXNAP)
+					wait = SPAWN_REAP_MAXNAP;
+			}
+
+			pfd.fd = pipefd[0];
+			pfd.events = POLLIN;
+
+			errn = poll(&pfd, 1, wait);
+			if (errn == -1 && errno == EINTR) {
+				errn = 1;
+				continue;
+			}
+
+			if (errn == 0) {
+				if (spawn_now() < deadline) {
+					errn = 1;
+					continue;
+				}
+				/* After SIGKILL there's nothing left to read */
+				deadline = spawn_escalate(f, prog, &stage);
+				errn = stage < 2;
+				continue;
+			}
+
 			while ((errn =
 				read(pipefd[0], errbuf + errp, ERRBUFSIZ - errp)) == -1
 			       && errno == EINTR);
@@ -316,10 +460,14 @@ static int do_spawn(int logpri, int use_lock, const char *prog, const char *cons
 				errp += errn;
 
 				sp = errbuf;
+				errbuf[errp] = '\0';
 
 				if((ap.max_nfs_mount_retries > 0) &&  retry_error_p(errbuf))
 				   found_retryable_error = 1 ;
 
+				if (hint_error_p(errbuf))
+					found_hint_error = 1;
+
 				while (errp && (p = memchr(sp, '\n', errp))) {
 					*p++ = '\0';
 					if (sp[0])	/* Don't output empty lines */
@@ -347,8 +495,56 @@ static int do_spawn(int logpri, int use_lock, const char *prog, const char *cons
 			syslog(logpri, ">> %s", errbuf);
 		}
 
-		if (waitpid(f, &status, 0) != f)
-			status = -1;	/* waitpid() failed */
+		/*
+		 * Closing its output doesn't mean the helper is done so
+		 * the deadline still applies while we wait for it.
+		 */
+		if (!deadline) {
+			while ((errn = waitpid(f, &status, 0)) == -1 &&
+			       errno == EINTR);
+			if (errn != f)
+				status = -1;	/* waitpid() failed */
+		} else {
+			long nap = 1;
+
+			while (!reaped) {
+				struct timespec t;
+				long long left;
+
+				errn = waitpid(f, &status, WNOHANG);
+				if (errn == f)
+					break;
+
+				if (errn == -1 && errno != EINTR) {
+					status = -1;	/* waitpid() failed */
+					break;
+				}
+
+				left = deadline - spawn_now();
+				if (left <= 0) {
+					deadline = spawn_escalate(f, prog, &stage);
+					if (!deadline)
+						break;
+					continue;
+				}
+
+				if (nap > left)
+					nap = left;
+				t.tv_sec = nap / 1000;
+				t.tv_nsec = (nap % 1000) * 1000000L;
+				nanosleep(&t, NULL);
+
+				if (nap < SPAWN_REAP_MAXNAP)
+					nap *= 2;
+			}
+		}
+
+		/* A wedged helper is not worth retrying against */
+		if (stage) {
+			found_retryable_error = 0;
+			found_hint_error = 0;
+			status = SPAWN_TIMEOUT;
+		}
 
 		if (use_lock)
 			release_lock();
@@ -13,6 +13,8 @@
 #include <paths.h>
 #include <limits.h>
 #include <time.h>
+#include <sys/time.h>
+#include <netinet/in.h>
 #include "config.h"
 
 /* OpenBSD re-entrant syslog */
@@ -40,10 +42,15 @@
 #define AUTOFS_SUPER_MAGIC 0x00000187L
 
 #define DEFAULT_TIMEOUT (5*60)			/* 5 minutes */
+#define DEFAULT_MOUNT_TIMEOUT	(5*60)		/* mount(8) deadline */
+#define DEFAULT_UMOUNT_TIMEOUT	(2*60)		/* umount(8) deadline */
+#define DEFAULT_FSCK_TIMEOUT	0		/* fsck may take forever */
 #define AUTOFS_LOCK	"/var/lock/autofs"	/* To serialize access to mount */
 #define MOUNTED_LOCK	_PATH_MOUNTED "~"	/* mounts' lock file */
+#define PROC_MOUNTS	"/proc/mounts"		/* the kernel's mount table */
 #define MTAB_NOTUPDATED 0x1000			/* mtab succeded but not updated */
 #define NOT_MOUNTED     0x0100			/* path notmounted */
+#define SPAWN_TIMEOUT	0x10000			/* helper killed by watchdog */
 
 /* Constants for lookup modules */
 
@@ -105,6 +112,8 @@ struct autofs_point {
 	char *path;			/* Mount point name */
 	int pipefd;			/* File descriptor for pipe */
 	int ioctlfd;			/* File descriptor for ioctls */
+	int rootfd;			/* Root directory for mkdir_path() */
+	int netlinkfd;			/* Tells of local address changes */
 	dev_t dev;			/* "Device" number assigned by kernel */
 	char *maptype;			/* Type of map "file", "NIS", etc */
 	unsigned int type;		/* Type of map direct or indirect */
@@ -120,6 +129,7 @@ struct autofs_point {
 					   mount? */
 	unsigned random_multimount;	/* use random policy when selecting a
 					 * host from which to mount */
+	unsigned hash_multimount;	/* use rendezvous hashing instead */
 	unsigned use_old_ldap_lookup;   /* query all schemas every time instead of sticking with the first one found */
 
 	unsigned ignore_stupid_paths;   /* Ignores mount keys that will never occur where bryder works and which slow everything down or lead to 'interesting' results 
@@ -128,8 +138,11 @@ struct autofs_point {
 
 	unsigned max_nfs_mount_retries; /* number of times to retry a failed nfs mount if it returns specified error messages (see mount_nfs.c for the errors */
 	unsigned nfs_mount_retry_pause; /* Time in seconds to pause between retrying nfs mounts */
-        
- 
+
+	time_t mount_timeout;		/* Deadlines for spawned mount, */
+	time_t umount_timeout;		/* umount and fsck helpers, 0 */
+	time_t fsck_timeout;		/* means wait forever */
+	time_t probe_interval;		/* Background server probing, 0 off */
 };
 
 extern struct autofs_point ap; 
@@ -278,10 +291,98 @@ int ncat_path(char *buf, size_t len,
 #define RPC_PING_FAIL           0x0000
 #define RPC_PING_V2             NFS2_VERSION
 #define RPC_PING_V3             NFS3_VERSION
+#define RPC_PING_V4             4	/* TCP to port 2049 only */
 #define RPC_PING_UDP            0x0100
 #define RPC_PING_TCP            0x0200
 
 unsigned int rpc_ping(const char *host, long seconds, long micros);
+unsigned int rpc_ping_v4(const char *host, long seconds, long micros);
+int rpc_portmap_ping(const char *host, long seconds, long micros);
+
+/* One host of a concurrent probe, see rpc_probe() */
+struct rpc_probe {
+	const char *host;		/* Server name */
+	int weight;			/* Lower is preferred, INT_MAX if none */
+	unsigned int status;		/* RPC_PING_* that answered, 0 if dead */
+	double time;			/* Round trip of the answering call */
+	int proximity;			/* PROXIMITY_*, see replicated_rank() */
+	const char *path;		/* Export, for REPLICA_HASH */
+	double pmap_time;		/* Round trip of GETPORT, rpc_sweep() */
+
+	/* Private to rpc_probe() */
+	struct sockaddr_in addr;
+	int stage;
+	int try;
+	int first;
+	int cached;
+	int sock;
+	unsigned long xid;
+	long sent;
+	long asked;
+	struct timeval stamp;
+	long retrans;
+	int sweep;
+};
+
+int rpc_probe(struct rpc_probe *hosts, int count,
+	      long soft_ms, long hard_ms, int all);
+int rpc_sweep(struct rpc_probe *hosts, int count, long timeout_ms);
+
+/* Host-wide table of NFS server health */
+#define SERVER_TABLE	"/var/run/autofs.servers"
+
+struct server_info {
+	unsigned int status;		/* RPC_PING_* that last answered */
+	double rtt;			/* Smoothed round trip, seconds */
+	time_t last_ok;			/* Last time it answered */
+	time_t last_fail;		/* Last time it didn't */
+	unsigned int failures;		/* Failures since it last answered */
+	time_t mount_fail;		/* Last time a mount from it failed */
+	unsigned int caps;		/* Version/transport pairs that worked */
+};
+
+int server_lookup(const char *host, struct server_info *info);
+void server_update(const char *host, unsigned int status, double rtt);
+int server_dead(const char *host);
+int server_mount_failed(const char *host);
+void server_failed(const char *host);
+long server_backoff(const char *host, long cap_ms);
+void server_mount_ok(const char *host);
+void server_mount_begin(const char *host);
+void server_mount_end(void);
+int server_fresh(const char *host, struct server_info *info);
+unsigned int server_status(const char *host);
+unsigned short server_port(const char *host,
+			   unsigned int vers, unsigned int proto);
+void server_set_port(const char *host, unsigned int vers,
+		     unsigned int proto, unsigned short port);
+void server_prober(time_t interval);
+
+/* Most addresses kept for a multi-homed server */
+#define SERVER_MAX_ADDRS	4
+
+int server_resolve(const char *host, struct in_addr *addrs, int max);
+int server_resolve_direct(const char *host, struct in_addr *addrs, int max);
+
+/* Addresses of this host, and how near others are to it */
+#define PROXIMITY_LOCAL		0	/* This host */
+#define PROXIMITY_SUBNET	1	/* On a subnet we have an address on */
+#define PROXIMITY_NET		2	/* Same /16 as one of our addresses */
+#define PROXIMITY_OTHER		3
+
+int local_addr_init(void);
+void local_addr_changed(int fd);
+int local_addr(struct in_addr addr);
+int local_proximity(struct in_addr addr);
+
+/* Choosing among the replicas of a mount */
+#define REPLICA_BEST	0	/* Nearest, then lowest weight, then fastest */
+#define REPLICA_RANDOM	1	/* Nearest, then any that answers */
+#define REPLICA_HASH	2	/* Rendezvous hash of client, server and path */
+
+int replicated_proximity(const char *host);
+int replicated_rank(struct rpc_probe *hosts, int count,
+		    int longtimeout, int policy);
 int rpc_time(const char *host, 
 	     unsigned int ping_vers, unsigned int ping_proto,
 	     long seconds, long micros, double *result);
@@ -302,6 +403,7 @@ struct mnt_list *get_base_mnt_list(struct mnt_list *list);
 void free_mnt_list(struct mnt_list *list);
 int contained_in_local_fs(const char *path);
 int is_mounted(const char *table, const char *path);
+int remove_mtab_entry(const char *path);
 int has_fstab_option(const char *path, const char *opt);
 int allow_owner_mount(const char *);
 
@@ -20,6 +20,7 @@
 #include <unistd.h>
 
 #include "mount.h"
+#include "automount.h"
 
 #define MAXHOSTLEN 256
 
@@ -51,7 +52,6 @@ exports is a list of dirpath and groups
 /* returns NULL on error or no exports available */
 exports get_export_list(char *hostname)
 {
-	struct hostent *hp;
 	struct sockaddr_in server_addr;
 	int msock;
 	CLIENT *mclient;
@@ -61,17 +61,12 @@ exports get_export_list(char *hostname)
 	struct timeval pertry_timeout;
 
 	/* get the servers address info all squared away */
-	if (inet_aton(hostname, (struct in_addr *) &server_addr.sin_addr.s_addr)) {
-		server_addr.sin_family = AF_INET;
-	} else {
-		if ((hp = gethostbyname(hostname)) == NULL) {
-			fprintf(stderr, "%s: can't get address for %s\n",
-				program_name, hostname);
-			return (NULL);
-		}
-		server_addr.sin_family = AF_INET;
-		memcpy(&server_addr.sin_addr, hp->h_addr, hp->h_length);
+	memset(&server_addr, 0, sizeof(server_addr));
+	if (!server_resolve(hostname, &server_addr.sin_addr, 1)) {
+		error("get_export_list: can't get address for %s", hostname);
+		return (NULL);
 	}
+	server_addr.sin_family = AF_INET;
 
 	/* create a client object.
 	 * first try a UDP client. if not
@@ -87,7 +82,8 @@ exports get_export_list(char *hostname)
 		if ((mclient = clntudp_create(&server_addr,
 					      MOUNTPROG, MOUNTVERS, pertry_timeout,
 					      &msock)) == NULL) {
-			clnt_pcreateerror("mount clntudp_create");
+			error("get_export_list: %s",
+			      clnt_spcreateerror(hostname));
 			return (NULL);
 		}
 	}
@@ -102,10 +98,13 @@ exports get_export_list(char *hostname)
 			      (xdrproc_t) xdr_exports, (caddr_t) & exportlist,
 			      total_timeout);
 	if (clnt_stat != RPC_SUCCESS) {
-		clnt_perror(mclient, "rpc mount export");
-		return (NULL);
+		error("get_export_list: %s", clnt_sperror(mclient, hostname));
+		exportlist = NULL;
 	}
 
+	auth_destroy(mclient->cl_auth);
+	clnt_destroy(mclient);
+
 	return (exportlist);
 }
 
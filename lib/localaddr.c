@@ -0,0 +1,223 @@
+#ident "$Id$"
+/* ----------------------------------------------------------------------- *
+ *
+ *  localaddr.c - addresses of this host's interfaces
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, Inc., 675 Mass Ave, Cambridge MA 02139,
+ *   USA; either version 2 of the License, or (at your option) any later
+ *   version; incorporated herein by reference.
+ *
+ *   The daemon reads the interface addresses once and keeps them in a
+ *   small hash, so mount children inherit them and can tell whether a
+ *   server is this host without making a socket for each address. A
+ *   netlink socket tells the daemon when addresses come and go. The
+ *   netmasks are kept too, to say how near a server is when it isn't
+ *   this host.
+ *
+ * ----------------------------------------------------------------------- */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <ifaddrs.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include "automount.h"
+
+#define LOCAL_SLOTS	256	/* Power of two */
+#define LOCAL_MAX	(LOCAL_SLOTS / 2)
+
+/* Mask for servers on the same network but not the same subnet */
+#define LOCAL_NETMASK	0xffff0000
+
+struct local_if {
+	in_addr_t addr;
+	in_addr_t mask;
+};
+
+static in_addr_t local_hash[LOCAL_SLOTS];
+static struct local_if local_ifs[LOCAL_MAX];
+static int local_nifs = 0;
+static int local_valid = 0;	/* 0 not read yet, -1 too many to hold */
+
+static unsigned int addr_slot(in_addr_t addr)
+{
+	return (ntohl(addr) * 2654435761U) & (LOCAL_SLOTS - 1);
+}
+
+static void local_addr_read(void)
+{
+	struct ifaddrs *ifa, *this;
+	int count = 0;
+
+	memset(local_hash, 0, sizeof(local_hash));
+	local_nifs = 0;
+	local_valid = 0;
+
+	if (getifaddrs(&ifa) == -1) {
+		error("local_addr_read: getifaddrs: %m");
+		return;
+	}
+
+	for (this = ifa; this; this = this->ifa_next) {
+		in_addr_t addr;
+		unsigned int i;
+
+		if (!this->ifa_addr || this->ifa_addr->sa_family != AF_INET)
+			continue;
+
+		addr = ((struct sockaddr_in *) this->ifa_addr)->sin_addr.s_addr;
+		if (addr == INADDR_ANY)
+			continue;
+
+		if (++count > LOCAL_MAX) {
+			warn("local_addr_read: more than %d addresses, "
+			     "checking the slow way", LOCAL_MAX);
+			local_valid = -1;
+			break;
+		}
+
+		for (i = addr_slot(addr);
+		     local_hash[i] && local_hash[i] != addr;
+		     i = (i + 1) & (LOCAL_SLOTS - 1))
+			;
+		local_hash[i] = addr;
+
+		local_ifs[local_nifs].addr = addr;
+		local_ifs[local_nifs].mask = this->ifa_netmask ?
+		    ((struct sockaddr_in *) this->ifa_netmask)->sin_addr.s_addr :
+		    INADDR_NONE;
+		local_nifs++;
+	}
+
+	freeifaddrs(ifa);
+
+	if (!local_valid) {
+		local_valid = 1;
+		debug("local_addr_read: %d local addresses", count);
+	}
+}
+
+/*
+ * Is addr one of ours? Returns -1 if we can't say, in which case the
+ * caller must find out for itself.
+ */
+int local_addr(struct in_addr addr)
+{
+	unsigned int i;
+
+	if (!local_valid)
+		local_addr_read();
+	if (local_valid != 1)
+		return -1;
+
+	for (i = addr_slot(addr.s_addr);
+	     local_hash[i]; i = (i + 1) & (LOCAL_SLOTS - 1)) {
+		if (local_hash[i] == addr.s_addr)
+			return 1;
+	}
+
+	return 0;
+}
+
+/*
+ * How near addr is, one of PROXIMITY_*, or -1 if we can't say. Only
+ * an address of our own is PROXIMITY_LOCAL, the rest of the loopback
+ * net is just on the same subnet.
+ */
+int local_proximity(struct in_addr addr)
+{
+	int best = PROXIMITY_OTHER;
+	int i;
+
+	switch (local_addr(addr)) {
+	case 1:
+		return PROXIMITY_LOCAL;
+	case -1:
+		return -1;
+	}
+
+	for (i = 0; i < local_nifs; i++) {
+		struct local_if *lif = &local_ifs[i];
+
+		if (!((addr.s_addr ^ lif->addr) & lif->mask))
+			return PROXIMITY_SUBNET;
+		if (!((addr.s_addr ^ lif->addr) & htonl(LOCAL_NETMASK)))
+			best = PROXIMITY_NET;
+	}
+
+	return best;
+}
+
+/*
+ * Read the local addresses, and return a netlink socket that becomes
+ * readable when they change, or -1 if we can't have one.
+ */
+int local_addr_init(void)
+{
+	struct sockaddr_nl snl;
+	int fd;
+
+	local_addr_read();
+
+	fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	if (fd < 0) {
+		debug("local_addr_init: netlink socket: %m");
+		return -1;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+
+	memset(&snl, 0, sizeof(snl));
+	snl.nl_family = AF_NETLINK;
+	snl.nl_groups = RTMGRP_IPV4_IFADDR;
+
+	if (bind(fd, (struct sockaddr *) &snl, sizeof(snl)) == -1) {
+		debug("local_addr_init: netlink bind: %m");
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/* The netlink socket is readable, see if our addresses changed */
+void local_addr_changed(int fd)
+{
+	char buf[4096];
+	int changed = 0;
+	ssize_t len;
+
+	while ((len = recv(fd, buf, sizeof(buf), 0)) != 0) {
+		struct nlmsghdr *nh;
+
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			/* We missed some, so assume the worst */
+			if (errno == ENOBUFS)
+				changed = 1;
+			break;
+		}
+
+		for (nh = (struct nlmsghdr *) buf;
+		     NLMSG_OK(nh, len); nh = NLMSG_NEXT(nh, len)) {
+			if (nh->nlmsg_type == RTM_NEWADDR ||
+			    nh->nlmsg_type == RTM_DELADDR)
+				changed = 1;
+		}
+	}
+
+	if (changed) {
+		debug("local_addr_changed: interface addresses changed");
+		local_addr_read();
+	}
+}
@@ -16,8 +16,8 @@
  *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
  *   GNU General Public License for more details.
  *
- *   This code has adapted from that found in mount/fstab.c of the
- *   util-linux package.
+ *   The lock serializes the mount(8) and umount(8) runs of every
+ *   automount process on the host, since they all update /etc/mtab.
  *
  * ----------------------------------------------------------------------- */
 
@@ -33,6 +33,8 @@
 #include <signal.h>
 #include <syslog.h>
 #include <errno.h>
+#include <limits.h>
+#include <paths.h>
 
 #include "automount.h"
 
@@ -40,20 +42,24 @@ static void setup_locksigs(void);
 static void reset_locksigs(void);
 
 /*
- * If waiting for 30 secs is not enough then there's
- * probably no good the requestor continuing anyway?
+ * Layout of the lock file. Byte ranges are used as independent
+ * locks and the file contents hold the next ticket number.
+ *
+ * Waiters take a ticket and lock their queue slot under the ticket
+ * lock, then wait for the slot of the ticket before theirs to be
+ * released before they go for the mutex. That hands the mutex over
+ * in the order it was asked for rather than to whoever the kernel
+ * happens to wake first. Exclusion comes from the mutex alone so a
+ * waiter that dies only lets its successor queue for the mutex
+ * early.
  */
-/* LOCK_TIMEOUT = WAIT_INTERVAL/10**9 * WAIT_TRIES */
-#define WAIT_INTERVAL	100000000L
-#define WAIT_TRIES	300
-#define LOCK_RETRIES    3
-#define MAX_PIDSIZE	20
+#define LOCK_TICKET	0
+#define LOCK_MUTEX	1
+#define LOCK_SLOTS	2
+#define NR_SLOTS	1024
 
 #define LOCK_FILE     AUTOFS_LOCK
 
-/* Flag for already existing lock file. */
-static int we_created_lockfile = 0;
-
 /* Flag to indicate that signals have been set up. */
 static int signals_have_been_setup = 0;
 
@@ -81,66 +87,6 @@ static void handler(int sig)
 		got_term = 1;
 }
 
-static int lock_is_owned(int fd)
-{
-	int pid = 0, tries = 3;
-
-	while (tries--) {
-		char pidbuf[MAX_PIDSIZE + 1];
-		int got;
-
-		lseek(fd, 0, SEEK_SET);
-		got = read(fd, pidbuf, MAX_PIDSIZE);
-		/*
-		 * We add a terminator to the pid to verify write complete.
-		 * If the write isn't finish in 300 milliseconds then it's
-		 * probably a stale lock file.
-		 */
-		if (got > 0 && pidbuf[got - 1] == '\n') {
-			sscanf(pidbuf, "%d", &pid);
-			break;
-		} else {
-			struct timespec t = { 0, 100000000 };
-			struct timespec r;
-
-			while (nanosleep(&t, &r) == -1 && errno == EINTR) {
-				/* So we can exit quickly, return owned */
-				if (got_term)
-					return 1;
-				memcpy(&t, &r, sizeof(struct timespec));
-			}
-			continue;
-		}
-
-		/* Stale lockfile */
-		if (!tries)
-			return 0;
-	}
-
-
-	if (pid) {
-		int ret;
-
-		ret = kill(pid, SIGCONT);
-		/* 
-		 * If lock file exists but is not owned by a process
-		 * we return unowned status so we can get rid of it
-		 * and continue.
-		 */
-		if (ret == -1 && errno == ESRCH)
-			return 0;
-	} else {
-		/*
-		 * Odd, no pid in file - so what should we do?
-		 * Assume something bad happened to owner and
-		 * return unowned status.
-		 */
-		return 0;
-	}
-
-	return 1;
-}
-
 static void setup_locksigs(void)
 {
 	int sig = 0;
@@ -184,148 +130,152 @@ static void reset_locksigs(void)
 	sigprocmask(SIG_UNBLOCK, &fullset, NULL);
 }
 
-/* Remove lock file. */
-void release_lock(void)
+/*
+ * Nothing but mount(8) and umount(8) writing /etc/mtab needs
+ * serializing so there's no need to lock when it is really the
+ * kernel's mount table.
+ */
+static int mtab_is_proc(void)
 {
-	if (fd > 0) {
-		close(fd);
-		fd = -1;
-	}
+	char buf[PATH_MAX + 1];
+	struct stat st;
+	int len;
 
-	if (we_created_lockfile) {
-		unlink (LOCK_FILE);
-		we_created_lockfile = 0;
-	}
+	if (lstat(_PATH_MOUNTED, &st) == -1 || !S_ISLNK(st.st_mode))
+		return 0;
 
-	if (signals_have_been_setup)
-		reset_locksigs();
+	len = readlink(_PATH_MOUNTED, buf, PATH_MAX);
+	if (len <= 0)
+		return 0;
+	buf[len] = '\0';
+
+	return strstr(buf, "proc/") != NULL;
 }
 
 /*
- * Wait for a lock file to be removed.
- * Return -1 for a timeout, 0 if a termination signal
- * is received or 1 for success.
+ * Take (type F_WRLCK) or drop (F_UNLCK) the lock on one byte of
+ * the lock file, waiting if asked to. Open file description locks
+ * are used where we have them so the lock belongs to this open of
+ * the file, otherwise we fall back to process associated locks.
  */
-static int wait_for_lockf(const char *lockf)
+static int lock_byte(off_t which, short type, int wait)
 {
-	int tries = WAIT_TRIES;
-	int status = 0;
-	struct stat st;
+	static int ofd_locks = 1;
+	struct flock fl;
+	int cmd;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = which;
+	fl.l_len = 1;
+
+	while (1) {
+#ifdef F_OFD_SETLKW
+		if (ofd_locks)
+			cmd = wait ? F_OFD_SETLKW : F_OFD_SETLK;
+		else
+#endif
+			cmd = wait ? F_SETLKW : F_SETLK;
+
+		if (fcntl(fd, cmd, &fl) != -1)
+			return 1;
+
+		if (errno == EINTR) {
+			/* So we can exit quickly */
+			if (got_term)
+				return 0;
+			continue;
+		}
 
-	while (tries-- && !status) {
-		status = stat(lockf, &st);
-		if (!status) {
-			struct timespec t = { 0, WAIT_INTERVAL };
-			struct timespec r;
-
-			while (nanosleep(&t, &r) == -1 && errno == EINTR) {
-				if (got_term)
-					return 0;
-				memcpy(&t, &r, sizeof(struct timespec));
-			}
+#ifdef F_OFD_SETLKW
+		/* Kernel older than 3.15 */
+		if (errno == EINVAL && ofd_locks) {
+			ofd_locks = 0;
+			continue;
 		}
+#endif
+		return 0;
 	}
+}
 
-	if (tries < 0)
-		return tries;
+/* Remove lock. */
+void release_lock(void)
+{
+	/* Closing the file drops every lock we have on it */
+	if (fd >= 0) {
+		close(fd);
+		fd = -1;
+	}
 
-	return 1;
+	if (signals_have_been_setup)
+		reset_locksigs();
 }
 
 /*
- * Aquire lock file taking account of autofs signals.
+ * Take a ticket and lock its queue slot, returning the slot of
+ * the waiter ahead of us or -1 if we can't take our place in the
+ * queue.
  */
-int aquire_lock(void)
+static off_t take_ticket(void)
 {
-	int tries = 3;
-	char *linkf;
-	int len;
+	unsigned int ticket = 0;
+	off_t slot = -1;
 
-	if (!signals_have_been_setup)
-		setup_locksigs();
+	if (!lock_byte(LOCK_TICKET, F_WRLCK, 1))
+		return -1;
 
-	len = strlen(LOCK_FILE) + MAX_PIDSIZE;
-	linkf = alloca(len + 1);
-	snprintf(linkf, len, "%s.%d", LOCK_FILE, getpid());
+	if (pread(fd, &ticket, sizeof(ticket), 0) != sizeof(ticket))
+		ticket = 0;
+	ticket++;
 
-	/* Repeat until it was us who made the link */
-	while (!we_created_lockfile) {
-		int errsv, i, j;
+	if (pwrite(fd, &ticket, sizeof(ticket), 0) == sizeof(ticket) &&
+	    lock_byte(LOCK_SLOTS + ticket % NR_SLOTS, F_WRLCK, 0))
+		slot = LOCK_SLOTS + (ticket - 1) % NR_SLOTS;
 
-		i = open(linkf, O_WRONLY|O_CREAT, 0);
-		if (i < 0) {
-			release_lock();
-			return 0;
-		}
-		close(i);
+	lock_byte(LOCK_TICKET, F_UNLCK, 0);
 
-		j = link(linkf, LOCK_FILE);
-		errsv = errno;
+	return slot;
+}
 
-		(void) unlink(linkf);
+/*
+ * Aquire lock file taking account of autofs signals.
+ */
+int aquire_lock(void)
+{
+	char mess[128] = "aquire_lock: can't lock lock file %s: %s";
+	off_t ahead;
 
-		if (j < 0 && errsv != EEXIST) {
-			release_lock();
-			return 0;
-		}
+	if (mtab_is_proc())
+		return 1;
 
-		fd = open(LOCK_FILE, O_RDWR);
-		if (fd < 0) {
-			/* Maybe the file was just deleted? */
-			if (errno == ENOENT && tries-- > 0)
-				continue;
-			release_lock();
-			return 0;
-		}
+	if (!signals_have_been_setup)
+		setup_locksigs();
 
-		if (j == 0) {
-			char pidbuf[MAX_PIDSIZE + 1];
-			int pidlen;
-
-			pidlen = sprintf(pidbuf, "%d\n", getpid());
-			write(fd, pidbuf, pidlen);
-
-			we_created_lockfile = 1;
-		} else {
-			int status;
-			char mess[128] =
-				"aquire_lock: can't lock lock file %s: %s";
-
-			/*
-			 * Someone else made the link.
-			 * If the lock file is not owned by anyone
-			 * clean it up and try again, otherwise we
-			 * wait.
-			 */
-			if (!lock_is_owned(fd)) {
-				close(fd);
-				fd = -1;
-				unlink(LOCK_FILE);
-				continue;
-			}
-
-			status = wait_for_lockf(LOCK_FILE);
-			if (status < 0) {
-				release_lock();
-				crit(mess, "timed out", LOCK_FILE);
-				return 0;
-			} else if (!status) {
-				release_lock();
-				crit(mess, "interrupted", LOCK_FILE);
-				return 0;
-			}
-		}
+	fd = open(LOCK_FILE, O_RDWR|O_CREAT, 0600);
+	if (fd < 0) {
+		crit(mess, LOCK_FILE, strerror(errno));
+		release_lock();
+		return 0;
+	}
+	/* Helpers we spawn must not inherit the lock */
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	/* If the queue is unusable we can still just wait our turn */
+	ahead = take_ticket();
+	if (ahead >= 0 && !got_term) {
+		if (lock_byte(ahead, F_WRLCK, 1))
+			lock_byte(ahead, F_UNLCK, 0);
+	}
 
-		if (got_term) {
-			got_term = 0;
-			release_lock();
-			return 0;
-		}
-		close(fd);
-		fd = -1;
+	if (got_term || !lock_byte(LOCK_MUTEX, F_WRLCK, 1)) {
+		crit(mess, LOCK_FILE,
+		     got_term ? "interrupted" : strerror(errno));
+		got_term = 0;
+		release_lock();
+		return 0;
 	}
 
 	reset_locksigs();
 	return 1;
 }
-
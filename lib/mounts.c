@@ -16,6 +16,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <syslog.h>
 #include <mntent.h>
 #include <limits.h>
@@ -26,6 +28,10 @@
 
 #include "automount.h"
 
+#define MTAB_TEMP		_PATH_MOUNTED ".tmp"
+#define MTAB_LOCK_RETRIES	50
+#define MTAB_LOCK_WAIT		100000		/* usecs */
+
 /*
  * Get list of mounts under path in longest->shortest order
  */
@@ -335,6 +341,115 @@ int is_mounted(const char *table, const char *path)
 	return ret;
 }
 
+/*
+ * Take mount(8)'s lock on mtab. The lock file is created exclusively,
+ * and fcntl locked as well so a mount(8) that finds it waits for us
+ * rather than deciding it is stale.
+ */
+static int lock_mtab(void)
+{
+	struct flock fl;
+	int fd, i;
+
+	for (i = 0; i < MTAB_LOCK_RETRIES; i++) {
+		fd = open(MOUNTED_LOCK, O_WRONLY|O_CREAT|O_EXCL, 0600);
+		if (fd >= 0 || errno != EEXIST)
+			break;
+		usleep(MTAB_LOCK_WAIT);
+	}
+
+	if (fd < 0)
+		return -1;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+	fcntl(fd, F_SETLK, &fl);
+
+	return fd;
+}
+
+static void unlock_mtab(int fd)
+{
+	unlink(MOUNTED_LOCK);
+	close(fd);
+}
+
+/*
+ * Drop the entry for a mount we took down behind umount(8)'s back.
+ * Nothing to do if mtab is the kernel's table. Only the last entry
+ * for path goes, that's the one that was on top.
+ */
+int remove_mtab_entry(const char *path)
+{
+	struct mntent *mnt;
+	FILE *in, *out;
+	struct stat st;
+	int count, n, fd, ret = 0;
+
+	if (lstat(_PATH_MOUNTED, &st) == -1 || S_ISLNK(st.st_mode))
+		return 1;
+
+	fd = lock_mtab();
+	if (fd < 0) {
+		error("remove_mtab_entry: can't lock %s: %m", _PATH_MOUNTED);
+		return 0;
+	}
+
+	in = setmntent(_PATH_MOUNTED, "r");
+	if (!in) {
+		error("remove_mtab_entry: setmntent: %m");
+		goto out;
+	}
+
+	count = 0;
+	while ((mnt = getmntent(in)) != NULL)
+		if (!strcmp(mnt->mnt_dir, path))
+			count++;
+
+	if (!count) {
+		endmntent(in);
+		ret = 1;
+		goto out;
+	}
+	rewind(in);
+
+	out = setmntent(MTAB_TEMP, "w");
+	if (!out) {
+		error("remove_mtab_entry: setmntent: %m");
+		endmntent(in);
+		goto out;
+	}
+
+	n = 0;
+	while ((mnt = getmntent(in)) != NULL) {
+		if (!strcmp(mnt->mnt_dir, path) && ++n == count)
+			continue;
+		if (addmntent(out, mnt)) {
+			error("remove_mtab_entry: addmntent: %m");
+			endmntent(out);
+			endmntent(in);
+			unlink(MTAB_TEMP);
+			goto out;
+		}
+	}
+	endmntent(in);
+
+	fchmod(fileno(out), 0644);
+	endmntent(out);
+
+	if (rename(MTAB_TEMP, _PATH_MOUNTED) == -1) {
+		error("remove_mtab_entry: rename: %m");
+		unlink(MTAB_TEMP);
+		goto out;
+	}
+	ret = 1;
+out:
+	unlock_mtab(fd);
+
+	return ret;
+}
+
 int has_fstab_option(const char *path, const char *opt)
 {
 	struct mntent ent;
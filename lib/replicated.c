@@ -0,0 +1,359 @@
+#ident "$Id$"
+/* ----------------------------------------------------------------------- *
+ *
+ *  replicated.c - choosing among the replicas of a mount
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, Inc., 675 Mass Ave, Cambridge MA 02139,
+ *   USA; either version 2 of the License, or (at your option) any later
+ *   version; incorporated herein by reference.
+ *
+ *   Servers are put in proximity classes from our interface addresses
+ *   and netmasks: this host, a subnet we are on, our /16, and the
+ *   rest. Only the nearest class with a server in it is probed, and
+ *   we look further out only when nobody there answers.
+ *
+ *   Or, to keep each client on the same server and spread clients
+ *   evenly, servers can be ranked by a rendezvous hash of this host's
+ *   name, the server and the export. Nobody is probed then; servers the
+ *   server table has down as dead just drop to the back.
+ *
+ * ----------------------------------------------------------------------- */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <alloca.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include "automount.h"
+
+#define RANK_SOFT	100	/* ms to wait for better answers than the first */
+#define RANK_LONG	10000	/* The same, when the caller can wait */
+#define RANK_HARD	10000	/* ms to wait for anybody at all */
+#define RANK_CLASS	1000	/* ms to give a class before looking further out */
+
+#define DISCARD_PORT	9
+
+/*
+ * Should a replica wait until the others have had their turn? Either
+ * it stopped answering probes or a mount from it failed lately.
+ */
+static int replica_down(const char *host)
+{
+	return server_dead(host) || server_mount_failed(host);
+}
+
+/*
+ * The slow way to tell if addr is ours, for when the local address
+ * set isn't available: see which address the kernel would send from.
+ */
+static int is_local_addr(const char *host, struct in_addr addr)
+{
+	struct sockaddr_in src_addr, local_addr;
+	socklen_t local_len = sizeof(local_addr);
+	int sock, ret;
+
+	sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (sock < 0) {
+		error("is_local_addr: socket creation failed: %m");
+		return -1;
+	}
+
+	memset(&src_addr, 0, sizeof(src_addr));
+	src_addr.sin_family = AF_INET;
+	src_addr.sin_addr = addr;
+	src_addr.sin_port = htons(DISCARD_PORT);
+
+	ret = connect(sock, (struct sockaddr *) &src_addr, sizeof(src_addr));
+	if (ret < 0) {
+		error("is_local_addr: connect failed for %s: %m", host);
+		close(sock);
+		return 0;
+	}
+
+	ret = getsockname(sock, (struct sockaddr *) &local_addr, &local_len);
+	close(sock);
+	if (ret < 0) {
+		error("is_local_addr: getsockname failed: %m");
+		return 0;
+	}
+
+	return src_addr.sin_addr.s_addr == local_addr.sin_addr.s_addr;
+}
+
+/*
+ * Proximity class of the nearest address of host, or -1 if the name
+ * doesn't resolve.
+ */
+int replicated_proximity(const char *host)
+{
+	struct in_addr addrs[SERVER_MAX_ADDRS];
+	int best = PROXIMITY_OTHER;
+	int naddrs, prox, i;
+
+	naddrs = server_resolve(host, addrs, SERVER_MAX_ADDRS);
+	if (!naddrs)
+		return -1;
+	if (naddrs > SERVER_MAX_ADDRS)
+		naddrs = SERVER_MAX_ADDRS;
+
+	for (i = 0; i < naddrs; i++) {
+		prox = local_proximity(addrs[i]);
+		if (prox < 0)
+			prox = is_local_addr(host, addrs[i]) > 0 ?
+				PROXIMITY_LOCAL : PROXIMITY_OTHER;
+		if (prox < best)
+			best = prox;
+	}
+
+	return best;
+}
+
+static void swap_hosts(struct rpc_probe *a, struct rpc_probe *b)
+{
+	struct rpc_probe tmp;
+
+	if (a == b)
+		return;
+	tmp = *a;
+	*a = *b;
+	*b = tmp;
+}
+
+/*
+ * Probe one class, which is at the front of hosts, unless the server
+ * table has a recent answer from every one of them. The live ones
+ * are then moved to the front in the order to try them.
+ */
+static int rank_class(struct rpc_probe *hosts, int count,
+		      int longtimeout, int policy, long hard_ms)
+{
+	struct server_info info;
+	int alive, i, j;
+
+	for (i = 0; i < count; i++) {
+		if (!server_fresh(hosts[i].host, &info))
+			break;
+		hosts[i].status = info.status;
+		hosts[i].time = info.rtt;
+	}
+
+	if (i < count)
+		rpc_probe(hosts, count,
+			  longtimeout ? RANK_LONG : RANK_SOFT, hard_ms,
+			  policy == REPLICA_RANDOM);
+	else {
+		debug("rank_class: using server table");
+	}
+
+	alive = 0;
+	for (i = 0; i < count; i++) {
+		if (hosts[i].status)
+			swap_hosts(&hosts[alive++], &hosts[i]);
+	}
+
+	if (policy == REPLICA_RANDOM) {
+		/* Each live host gets a fair chance */
+		for (i = alive - 1; i > 0; i--)
+			swap_hosts(&hosts[i], &hosts[random() % (i + 1)]);
+		return alive;
+	}
+
+	/* Lowest weight, then fastest, first */
+	for (i = 1; i < alive; i++) {
+		for (j = i; j > 0; j--) {
+			struct rpc_probe *a = &hosts[j - 1], *b = &hosts[j];
+
+			if (a->weight < b->weight ||
+			    (a->weight == b->weight && a->time <= b->time))
+				break;
+			swap_hosts(a, b);
+		}
+	}
+
+	return alive;
+}
+
+/* FNV-1a, carried on from hash */
+static unsigned long long fnv(unsigned long long hash, const char *str)
+{
+	do {
+		hash ^= (unsigned char) *str;
+		hash *= 0x100000001b3ULL;
+	} while (*str++);
+
+	return hash;
+}
+
+static unsigned long long rendezvous(const char *client,
+				     const char *server, const char *path)
+{
+	unsigned long long hash = 0xcbf29ce484222325ULL;
+
+	hash = fnv(hash, client);
+	hash = fnv(hash, server);
+	hash = fnv(hash, path ? path : "");
+
+	/* Mix the bits, FNV alone leaves similar names close */
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+
+	return hash;
+}
+
+/*
+ * Lowest weight first, then highest score for this client. Servers
+ * known to be dead go last, in the same order.
+ */
+static int rank_hash(struct rpc_probe *hosts, int count)
+{
+	static char client[HOST_NAME_MAX + 1];
+	unsigned long long *score;
+	int *dead;
+	int i, j;
+
+	if (!client[0] && gethostname(client, sizeof(client) - 1))
+		strcpy(client, "localhost");
+
+	score = alloca(count * sizeof(*score));
+	dead = alloca(count * sizeof(*dead));
+
+	for (i = 0; i < count; i++) {
+		score[i] = rendezvous(client, hosts[i].host, hosts[i].path);
+		dead[i] = replica_down(hosts[i].host);
+		/* What we know of it, for the mount options */
+		hosts[i].status = dead[i] ? 0 : server_status(hosts[i].host);
+	}
+
+	for (i = 1; i < count; i++) {
+		for (j = i; j > 0; j--) {
+			struct rpc_probe *a = &hosts[j - 1], *b = &hosts[j];
+			unsigned long long s;
+			int d;
+
+			if (dead[j - 1] < dead[j] ||
+			    (dead[j - 1] == dead[j] &&
+			     (a->weight < b->weight ||
+			      (a->weight == b->weight &&
+			       score[j - 1] >= score[j]))))
+				break;
+
+			swap_hosts(a, b);
+			s = score[j - 1];
+			score[j - 1] = score[j];
+			score[j] = s;
+			d = dead[j - 1];
+			dead[j - 1] = dead[j];
+			dead[j] = d;
+		}
+	}
+
+	debug("rank_hash: %s first", hosts[0].host);
+
+	return count;
+}
+
+/*
+ * Put hosts in the order they should be tried. Returns how many at
+ * the front are in that order, all from the nearest class that had
+ * a live server, or 0 if nobody answered. With REPLICA_RANDOM the
+ * live ones come in random order rather than by weight and speed. A
+ * local host comes back on its own, unprobed. Servers the server
+ * table has down as dead, or as failing mounts, are only tried once
+ * nobody else answers.
+ * With REPLICA_HASH all of them come back, ranked by their paths.
+ */
+int replicated_rank(struct rpc_probe *hosts, int count,
+		    int longtimeout, int policy)
+{
+	int in_class[PROXIMITY_OTHER + 1];
+	int skip_dead, dead = 0;
+	int class, n, i;
+
+	for (i = 0; i < count; i++) {
+		struct rpc_probe *h = &hosts[i];
+
+		h->status = 0;
+		h->time = 0;
+
+		/* Unresolvable ones fail in rpc_probe() */
+		h->proximity = replicated_proximity(h->host);
+		if (h->proximity < 0)
+			h->proximity = PROXIMITY_OTHER;
+
+		if (h->proximity == PROXIMITY_LOCAL) {
+			debug("replicated_rank: host %s: is localhost",
+			      h->host);
+			swap_hosts(&hosts[0], h);
+			return 1;
+		}
+
+		if (replica_down(h->host))
+			dead++;
+	}
+
+	if (policy == REPLICA_HASH)
+		return rank_hash(hosts, count);
+
+	skip_dead = dead < count;
+	if (!skip_dead)
+		debug("replicated_rank: all servers marked dead, "
+		      "probing anyway");
+
+	memset(in_class, 0, sizeof(in_class));
+	for (i = 0; i < count; i++) {
+		if (!skip_dead || !replica_down(hosts[i].host))
+			in_class[hosts[i].proximity]++;
+	}
+
+	for (class = PROXIMITY_SUBNET; class <= PROXIMITY_OTHER; class++) {
+		long hard_ms = RANK_HARD;
+		int further = 0;
+
+		if (!in_class[class])
+			continue;
+
+		/* Gather the class at the front */
+		for (i = 0, n = 0; i < count; i++) {
+			if (hosts[i].proximity != class ||
+			    (skip_dead && replica_down(hosts[i].host)))
+				continue;
+			swap_hosts(&hosts[n++], &hosts[i]);
+		}
+
+		for (i = class + 1; i <= PROXIMITY_OTHER; i++)
+			further += in_class[i];
+		if (skip_dead)
+			further += dead;
+		if (further && !longtimeout)
+			hard_ms = RANK_CLASS;
+
+		n = rank_class(hosts, n, longtimeout, policy, hard_ms);
+		if (n)
+			return n;
+
+		if (further)
+			debug("replicated_rank: no answer from class %d, "
+			      "looking further out", class);
+	}
+
+	if (!skip_dead || !dead)
+		return 0;
+
+	debug("replicated_rank: no answer, trying servers marked dead");
+
+	for (i = 0, n = 0; i < count; i++) {
+		if (replica_down(hosts[i].host))
+			swap_hosts(&hosts[n++], &hosts[i]);
+	}
+
+	return rank_class(hosts, n, longtimeout, policy, RANK_HARD);
+}
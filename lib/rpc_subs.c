@@ -22,7 +22,10 @@
 #include <rpc/xdr.h>
 
 #include <unistd.h>
+#include <stdint.h>
 #include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/poll.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <sys/fcntl.h>
@@ -33,6 +36,11 @@
 #define PMAP_TOUT_UDP	2
 #define PMAP_TOUT_TCP	3
 
+#define PROBE_RETRANS_MIN	100	/* ms before the first resend */
+#define PROBE_RETRANS_MAX	1000	/* ms between resends at most */
+#define PROBE_TCP_WAIT		1000	/* ms for a connect, then for its NULL reply */
+#define PROBE_MSGSIZE		64	/* 32 bit words, ample for our calls */
+
 struct conn_info {
 	const char *host;
 	unsigned short port;
@@ -52,7 +60,6 @@ static CLIENT* create_udp_client(struct conn_info *info)
 	int fd;
 	CLIENT *client;
 	struct sockaddr_in laddr, raddr;
-	struct hostent *hp;
 
 	if (info->proto->p_proto != IPPROTO_UDP)
 		return NULL;
@@ -60,13 +67,11 @@ static CLIENT* create_udp_client(struct conn_info *info)
 	memset(&laddr, 0, sizeof(laddr));
 	memset(&raddr, 0, sizeof(raddr));
 
-	hp = gethostbyname(info->host);
-	if (!hp)
+	if (!server_resolve(info->host, &raddr.sin_addr, 1))
 		return NULL;
 
 	raddr.sin_family = AF_INET;
 	raddr.sin_port = htons(info->port);
-	memcpy(&raddr.sin_addr.s_addr, hp->h_addr, hp->h_length);
 
 	/*
 	 * bind to any unused port.  If we left this up to the rpc
@@ -166,60 +171,70 @@ done:
 }
 
 /*
- * Create a TCP RPC client using non-blocking connect
+ * Create a TCP RPC client using non-blocking connect. Each address of
+ * a multi-homed server is tried in turn, within the one timeout.
  */
 static CLIENT* create_tcp_client(struct conn_info *info)
 {
 	int fd;
 	CLIENT *client;
 	struct sockaddr_in addr;
-	struct hostent *hp;
+	struct in_addr addrs[SERVER_MAX_ADDRS];
+	int naddrs, i;
 	int ret;
 
 	if (info->proto->p_proto != IPPROTO_TCP)
 		return NULL;
 
-	memset(&addr, 0, sizeof(addr));
-
-	hp = gethostbyname(info->host);
-	if (!hp)
-		return NULL;
-
-	addr.sin_family = AF_INET;
-	addr.sin_port = htons(info->port);
-	memcpy(&addr.sin_addr.s_addr, hp->h_addr, hp->h_length);
-
-	fd = socket(PF_INET, SOCK_STREAM, info->proto->p_proto);
-	if (fd < 0)
-		return NULL;
-
-	ret = connect_nb(fd, &addr, &info->timeout);
-	if (ret < 0)
-		goto out_close;
-
-	client = clnttcp_create(&addr,
-				info->program, info->version, &fd,
-				info->send_sz, info->recv_sz);
-	if (!client)
-		goto out_close;
+	naddrs = server_resolve(info->host, addrs, SERVER_MAX_ADDRS);
+	if (naddrs > SERVER_MAX_ADDRS)
+		naddrs = SERVER_MAX_ADDRS;
+
+	for (i = 0; i < naddrs; i++) {
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(info->port);
+		addr.sin_addr = addrs[i];
+
+		fd = socket(PF_INET, SOCK_STREAM, info->proto->p_proto);
+		if (fd < 0)
+			return NULL;
+
+		ret = connect_nb(fd, &addr, &info->timeout);
+		if (ret < 0)
+			goto next;
+
+		client = clnttcp_create(&addr,
+					info->program, info->version, &fd,
+					info->send_sz, info->recv_sz);
+		if (!client)
+			goto next;
+
+		/* Close socket fd on destroy, as is default for rpcowned fds */
+		if  (!clnt_control(client, CLSET_FD_CLOSE, NULL)) {
+			clnt_destroy(client);
+			goto next;
+		}
 
-	/* Close socket fd on destroy, as is default for rpcowned fds */
-	if  (!clnt_control(client, CLSET_FD_CLOSE, NULL)) {
-		clnt_destroy(client);
-		goto out_close;
+		return client;
+next:
+		close(fd);
+		if (ret == -ETIMEDOUT)
+			break;
 	}
 
-	return client;
-
-out_close:
-	close(fd);
 	return NULL;
 }
 
+/*
+ * NFS ports are looked up in the server table first, and what the
+ * portmapper tells us goes back there.
+ */
 static unsigned short portmap_getport(struct conn_info *info)
 {
 	struct conn_info pmap_info;
 	unsigned short port = 0;
+	unsigned int proto;
 	CLIENT *client;
 	enum clnt_stat stat;
 	struct pmap parms;
@@ -234,6 +249,14 @@ static unsigned short portmap_getport(struct conn_info *info)
 	pmap_info.timeout.tv_sec = PMAP_TOUT_UDP;
 	pmap_info.timeout.tv_usec = 0;
 
+	proto = info->proto->p_proto == IPPROTO_TCP ?
+			RPC_PING_TCP : RPC_PING_UDP;
+	if (info->program == NFS_PROGRAM) {
+		port = server_port(info->host, info->version, proto);
+		if (port)
+			return port;
+	}
+
 	if (info->proto->p_proto == IPPROTO_TCP) {
 		pmap_info.timeout.tv_sec = PMAP_TOUT_TCP;
 		client = create_tcp_client(&pmap_info);
@@ -258,9 +281,20 @@ static unsigned short portmap_getport(struct conn_info *info)
 	if (stat != RPC_SUCCESS)
 		return 0;
 
+	if (info->program == NFS_PROGRAM && port)
+		server_set_port(info->host, info->version, proto, port);
+
 	return port;
 }
 
+static double elapsed(struct timeval start, struct timeval end)
+{
+	double t1, t2;
+	t1 =  (double)start.tv_sec + (double)start.tv_usec/(1000*1000);
+	t2 =  (double)end.tv_sec + (double)end.tv_usec/(1000*1000);
+	return t2-t1;
+}
+
 static int rpc_ping_proto(const char *host,
 			  unsigned long nfs_version,
 			  const char *proto,
@@ -270,6 +304,7 @@ static int rpc_ping_proto(const char *host,
 	CLIENT *client;
 	enum clnt_stat stat;
 	struct protoent *prot;
+	struct timeval start, end;
 
 	prot = getprotobyname(proto);
 	if (!prot)
@@ -284,7 +319,13 @@ static int rpc_ping_proto(const char *host,
 	info.timeout.tv_sec = seconds;
 	info.timeout.tv_usec = micros;
 
-	info.port = portmap_getport(&info);
+	/* NFSv4 has no portmapper to ask */
+	if (nfs_version == RPC_PING_V4) {
+		if (prot->p_proto != IPPROTO_TCP)
+			return 0;
+		info.port = NFS_PORT;
+	} else
+		info.port = portmap_getport(&info);
 	if (!info.port)
 		return 0;
 
@@ -295,20 +336,35 @@ static int rpc_ping_proto(const char *host,
 	} else
 		client = create_tcp_client(&info);
 
-	if (!client)
+	if (!client) {
+		server_set_port(host, nfs_version,
+				prot->p_proto == IPPROTO_TCP ?
+				RPC_PING_TCP : RPC_PING_UDP, 0);
 		return 0;
+	}
 
 	clnt_control(client, CLSET_TIMEOUT, (char *) &info.timeout);
 	clnt_control(client, CLSET_RETRY_TIMEOUT, (char *) &info.timeout);
 
+	gettimeofday(&start, NULL);
 	stat = clnt_call(client, NFSPROC_NULL,
 			 (xdrproc_t) xdr_void, 0, (xdrproc_t) xdr_void, 0,
 			 info.timeout);
+	gettimeofday(&end, NULL);
 
 	clnt_destroy(client);
 
-	if (stat != RPC_SUCCESS)
+	if (stat != RPC_SUCCESS) {
+		/* Whatever we knew about it is suspect now */
+		server_set_port(host, nfs_version,
+				prot->p_proto == IPPROTO_TCP ?
+				RPC_PING_TCP : RPC_PING_UDP, 0);
 		return 0;
+	}
+
+	server_update(host, nfs_version | (prot->p_proto == IPPROTO_TCP ?
+					   RPC_PING_TCP : RPC_PING_UDP),
+		      elapsed(start, end));
 
 	return 1;
 }
@@ -343,25 +399,77 @@ static unsigned int rpc_ping_v3(const char *host, long seconds, long micros)
 	return status;
 }
 
+unsigned int rpc_ping_v4(const char *host, long seconds, long micros)
+{
+	if (rpc_ping_proto(host, RPC_PING_V4, "tcp", seconds, micros))
+		return RPC_PING_V4 | RPC_PING_TCP;
+
+	return RPC_PING_FAIL;
+}
+
 unsigned int rpc_ping(const char *host, long seconds, long micros)
 {
 	unsigned int status;
 
+	/* What worked last time is worth one try on its own */
+	status = server_status(host);
+	if (status &&
+	    rpc_ping_proto(host, status & 0xff,
+			   (status & RPC_PING_TCP) ? "tcp" : "udp",
+			   seconds, micros))
+		return status;
+
 	status = rpc_ping_v2(host, seconds, micros);
 	if (status)
 		return status;
 
 	status = rpc_ping_v3(host, seconds, micros);
-	
+	if (status)
+		return status;
+
+	status = rpc_ping_v4(host, seconds, micros);
+
 	return status;
 }
 
-static double elapsed(struct timeval start, struct timeval end)
+/*
+ * Cheap check that a host is answering at all: one NULL call to its
+ * portmapper over UDP, no retries beyond the timeout given.
+ */
+int rpc_portmap_ping(const char *host, long seconds, long micros)
 {
-	double t1, t2;
-	t1 =  (double)start.tv_sec + (double)start.tv_usec/(1000*1000);
-	t2 =  (double)end.tv_sec + (double)end.tv_usec/(1000*1000);
-	return t2-t1;
+	struct conn_info info;
+	CLIENT *client;
+	enum clnt_stat stat;
+	struct protoent *prot;
+
+	prot = getprotobyname("udp");
+	if (!prot)
+		return 1;
+
+	info.host = host;
+	info.port = PMAPPORT;
+	info.program = PMAPPROG;
+	info.version = PMAPVERS;
+	info.proto = prot;
+	info.send_sz = RPCSMALLMSGSIZE;
+	info.recv_sz = RPCSMALLMSGSIZE;
+	info.timeout.tv_sec = seconds;
+	info.timeout.tv_usec = micros;
+
+	client = create_udp_client(&info);
+	if (!client)
+		return 0;
+
+	clnt_control(client, CLSET_RETRY_TIMEOUT, (char *) &info.timeout);
+
+	stat = clnt_call(client, PMAPPROC_NULL,
+			 (xdrproc_t) xdr_void, 0, (xdrproc_t) xdr_void, 0,
+			 info.timeout);
+
+	clnt_destroy(client);
+
+	return stat == RPC_SUCCESS;
 }
 
 int rpc_time(const char *host,
@@ -390,33 +498,649 @@ int rpc_time(const char *host,
 	return status;
 }
 
-#if 0
-#include <stdio.h>
+/*
+ * Concurrent probing of a set of servers.
+ *
+ * Every host is taken through the (version, transport) combinations
+ * below in turn, starting with the one that worked last time: a
+ * GETPORT to its portmapper, unless the server table has the port,
+ * then a NULL call to NFS, over UDP or on its own TCP connection.
+ * All UDP traffic goes over one socket, replies are matched to hosts
+ * by XID.
+ *
+ * NFSv4 has no portmapper, so it is tried last straight on port 2049,
+ * and so is v3 in case it is only the portmapper that is firewalled.
+ * A host whose portmapper doesn't answer at all is moved on to these
+ * at once, rather than left waiting for it.
+ *
+ * rpc_sweep() uses the same machinery to time single combinations,
+ * for autofs-rpcprobe.
+ */
+enum probe_stage {
+	PROBE_GETPORT,
+	PROBE_NULL,
+	PROBE_CONNECT,
+	PROBE_TCPNULL,
+	PROBE_DONE
+};
+
+static const struct {
+	unsigned int vers;
+	unsigned int proto;
+	unsigned short port;		/* 0 ask the portmapper */
+} probe_order[] = {
+	{ NFS3_VERSION, RPC_PING_UDP, 0 },
+	{ NFS2_VERSION, RPC_PING_UDP, 0 },
+	{ NFS3_VERSION, RPC_PING_TCP, 0 },
+	{ NFS2_VERSION, RPC_PING_TCP, 0 },
+	{ RPC_PING_V4, RPC_PING_TCP, NFS_PORT },
+	{ NFS3_VERSION, RPC_PING_TCP, NFS_PORT },
+};
 
-int main(int argc, char **argv)
+#define PROBE_TRIES	(sizeof(probe_order) / sizeof(probe_order[0]))
+#define PROBE_DIRECT	4	/* First entry that doesn't need the portmapper */
+
+/*
+ * How long the portmapper is asked before NFS is tried on 2049: a
+ * share of the caller's hard timeout, so that a slow v3 server on a
+ * long link isn't taken for one with v4 only, but never so little
+ * that the next resend doesn't get a chance.
+ */
+#define PROBE_PMAP_SHARE	4
+#define PROBE_PMAP_MIN		(PROBE_RETRANS_MIN * 3)
+
+/* Where a host is in probe_order: what worked last time, then the rest */
+static int probe_combo(struct rpc_probe *h)
 {
-	int ret;
-	double res = 0.0;
+	if (h->first < 0 || h->try > h->first)
+		return h->try;
+	if (h->try == 0)
+		return h->first;
+	return h->try - 1;
+}
+
+/* Forget a cached port that has let us down */
+static void probe_uncache(struct rpc_probe *h)
+{
+	int c = probe_combo(h);
+
+	if (h->cached) {
+		server_set_port(h->host, probe_order[c].vers,
+				probe_order[c].proto, 0);
+		h->cached = 0;
+	}
+}
+
+static long probe_now(void)
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+
+	return tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/* Note when a call went out, finer than probe_now() for the timings */
+static void probe_stamp(struct rpc_probe *h)
+{
+	gettimeofday(&h->stamp, NULL);
+	h->sent = h->stamp.tv_sec * 1000 + h->stamp.tv_usec / 1000;
+}
+
+/* Seconds since the call went out */
+static double probe_rtt(struct rpc_probe *h)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+
+	return elapsed(h->stamp, now);
+}
+
+/* Build an AUTH_NULL call header, returns its length in words */
+static int probe_header(uint32_t *msg, unsigned long xid,
+			unsigned long prog, unsigned long vers,
+			unsigned long proc)
+{
+	msg[0] = htonl(xid);
+	msg[1] = htonl(CALL);
+	msg[2] = htonl(RPC_MSG_VERSION);
+	msg[3] = htonl(prog);
+	msg[4] = htonl(vers);
+	msg[5] = htonl(proc);
+	msg[6] = htonl(AUTH_NULL);
+	msg[7] = 0;
+	msg[8] = htonl(AUTH_NULL);
+	msg[9] = 0;
+
+	return 10;
+}
+
+/*
+ * Check a reply is an accepted, successful one. Returns the offset
+ * in words of the results, or -1.
+ */
+static int probe_reply(const uint32_t *msg, int words)
+{
+	int off;
 
-	ret = rpc_ping("budgie", 10, 0);
-	printf("ret = %d\n", ret);
+	if (words < 6 ||
+	    ntohl(msg[1]) != REPLY || ntohl(msg[2]) != MSG_ACCEPTED)
+		return -1;
+
+	/* Skip the verifier */
+	off = 5 + (ntohl(msg[4]) + 3) / 4;
+	if (off >= words || ntohl(msg[off]) != SUCCESS)
+		return -1;
+
+	return off + 1;
+}
+
+static void probe_send(int sock, struct rpc_probe *h, unsigned long *xid)
+{
+	uint32_t msg[PROBE_MSGSIZE];
+	struct sockaddr_in addr = h->addr;
+	int c = probe_combo(h);
+	int len;
+
+	h->xid = (*xid)++ & 0xffffffffUL;
+
+	if (h->stage == PROBE_GETPORT) {
+		int proto = probe_order[c].proto == RPC_PING_UDP ?
+				IPPROTO_UDP : IPPROTO_TCP;
+
+		len = probe_header(msg, h->xid,
+				   PMAPPROG, PMAPVERS, PMAPPROC_GETPORT);
+		msg[len++] = htonl(NFS_PROGRAM);
+		msg[len++] = htonl(probe_order[c].vers);
+		msg[len++] = htonl(proto);
+		msg[len++] = 0;
+		addr.sin_port = htons(PMAPPORT);
+	} else
+		len = probe_header(msg, h->xid, NFS_PROGRAM,
+				   probe_order[c].vers, NFSPROC_NULL);
+
+	sendto(sock, msg, len * sizeof(uint32_t), 0,
+	       (struct sockaddr *) &addr, sizeof(addr));
+	probe_stamp(h);
+}
+
+static void probe_connect(int sock, struct rpc_probe *h,
+			  unsigned short port, unsigned long *xid);
+static void probe_tcp_send(int sock, struct rpc_probe *h, unsigned long *xid);
+
+/* Move on to the next combination, or give up on the host */
+static void probe_next(int sock, struct rpc_probe *h, unsigned long *xid)
+{
+	if (h->sock >= 0) {
+		close(h->sock);
+		h->sock = -1;
+	}
+
+	/* A sweep has the one combination */
+	if (h->stage != PROBE_DONE && !(h->sweep && h->try >= 0) &&
+	    ++h->try < PROBE_TRIES) {
+		int c = probe_combo(h);
+		unsigned short port;
+
+		/* Skip the portmapper if we know where NFS is */
+		port = probe_order[c].port;
+		if (!port && !h->sweep) {
+			port = server_port(h->host, probe_order[c].vers,
+					   probe_order[c].proto);
+			h->cached = port != 0;
+		} else
+			h->cached = 0;
+		h->retrans = PROBE_RETRANS_MIN;
+		h->asked = probe_now();
+
+		if (port && probe_order[c].proto == RPC_PING_TCP) {
+			probe_connect(sock, h, port, xid);
+			return;
+		}
+
+		if (port) {
+			h->addr.sin_port = htons(port);
+			h->stage = PROBE_NULL;
+		} else
+			h->stage = PROBE_GETPORT;
+		probe_send(sock, h, xid);
+	} else
+		h->stage = PROBE_DONE;
+}
+
+static void probe_alive(struct rpc_probe *h)
+{
+	int c = probe_combo(h);
+
+	h->status = probe_order[c].vers | probe_order[c].proto;
+	h->time = probe_rtt(h);
+	h->stage = PROBE_DONE;
+
+	if (h->sock >= 0) {
+		close(h->sock);
+		h->sock = -1;
+	}
+}
+
+static void probe_connect(int sock, struct rpc_probe *h,
+			  unsigned short port, unsigned long *xid)
+{
+	struct sockaddr_in addr = h->addr;
+	int fd;
+
+	fd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (fd < 0) {
+		probe_next(sock, h, xid);
+		return;
+	}
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+	addr.sin_port = htons(port);
+	h->sock = fd;
+	h->stage = PROBE_CONNECT;
+	probe_stamp(h);
 
-	res = 0.0;
-	ret = rpc_time("raven", NFS2_VERSION, RPC_PING_TCP, 10, 0, &res);
-	printf("v2 tcp ret = %d, res = %f\n", ret, res);
+	if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0)
+		probe_tcp_send(sock, h, xid);
+	else if (errno != EINPROGRESS)
+		probe_next(sock, h, xid);
+}
 
-	res = 0.0;
-	ret = rpc_time("raven", NFS3_VERSION, RPC_PING_TCP, 10, 0, &res);
-	printf("v3 tcp ret = %d, res = %f\n", ret, res);
+/*
+ * Connected, now make sure it's NFS of the version we want. The call
+ * is small enough to go in one record, and in one write on a new
+ * connection.
+ */
+static void probe_tcp_send(int sock, struct rpc_probe *h, unsigned long *xid)
+{
+	uint32_t msg[PROBE_MSGSIZE];
+	int c = probe_combo(h);
+	int len;
+
+	h->xid = (*xid)++ & 0xffffffffUL;
+	len = probe_header(msg + 1, h->xid, NFS_PROGRAM,
+			   probe_order[c].vers, NFSPROC_NULL);
+	msg[0] = htonl(0x80000000 | (len * sizeof(uint32_t)));
+	len++;
+
+	if (send(h->sock, msg, len * sizeof(uint32_t), MSG_NOSIGNAL) !=
+	    len * sizeof(uint32_t)) {
+		probe_uncache(h);
+		probe_next(sock, h, xid);
+		return;
+	}
+	h->stage = PROBE_TCPNULL;
 
-	res = 0.0;
-	ret = rpc_time("raven", NFS2_VERSION, RPC_PING_UDP, 10, 0, &res);
-	printf("v2 udp ret = %d, res = %f\n", ret, res);
+	/* The reply gets its own wait, the round trip still counts the connect */
+	h->sent = probe_now();
+}
 
-	res = 0.0;
-	ret = rpc_time("raven", NFS3_VERSION, RPC_PING_UDP, 10, 0, &res);
-	printf("v3 udp ret = %d, res = %f\n", ret, res);
+/* Still asking the portmapper, with the direct combinations to come? */
+static int probe_pmap_direct(struct rpc_probe *h)
+{
+	return h->stage == PROBE_GETPORT && !h->sweep &&
+		h->try < PROBE_DIRECT && h->first < PROBE_DIRECT;
+}
+
+/* The reply to probe_tcp_send(), all in one record */
+static void probe_tcp_recv(int sock, struct rpc_probe *h, unsigned long *xid)
+{
+	uint32_t msg[PROBE_MSGSIZE];
+	int len;
+
+	len = recv(h->sock, msg, sizeof(msg), MSG_DONTWAIT);
+	if (len < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+
+	/* A reset or refused connection comes back as -1 */
+	if (len < (int) (2 * sizeof(uint32_t)) ||
+	    ntohl(msg[1]) != h->xid ||
+	    probe_reply(msg + 1, len / sizeof(uint32_t) - 1) < 0) {
+		probe_uncache(h);
+		probe_next(sock, h, xid);
+		return;
+	}
+
+	probe_alive(h);
+}
 
-	exit(0);
+static void probe_recv(int sock, struct rpc_probe *hosts, int count,
+		       unsigned long *xid)
+{
+	uint32_t msg[PROBE_MSGSIZE];
+	unsigned long rxid;
+	int len, off, c, i;
+
+	while ((len = recv(sock, msg, sizeof(msg), MSG_DONTWAIT)) > 0) {
+		if (len < sizeof(uint32_t))
+			continue;
+		rxid = ntohl(msg[0]);
+
+		for (i = 0; i < count; i++) {
+			struct rpc_probe *h = &hosts[i];
+
+			if ((h->stage == PROBE_GETPORT ||
+			     h->stage == PROBE_NULL) && h->xid == rxid)
+				break;
+		}
+		if (i == count)
+			continue;
+
+		off = probe_reply(msg, len / sizeof(uint32_t));
+		if (off < 0) {
+			probe_uncache(&hosts[i]);
+			probe_next(sock, &hosts[i], xid);
+			continue;
+		}
+
+		if (hosts[i].stage == PROBE_NULL) {
+			probe_alive(&hosts[i]);
+			continue;
+		}
+
+		/* GETPORT answer */
+		if (off >= len / sizeof(uint32_t) || !ntohl(msg[off])) {
+			probe_next(sock, &hosts[i], xid);
+			continue;
+		}
+
+		c = probe_combo(&hosts[i]);
+		if (hosts[i].sweep)
+			hosts[i].pmap_time = probe_rtt(&hosts[i]);
+		else
+			server_set_port(hosts[i].host, probe_order[c].vers,
+					probe_order[c].proto, ntohl(msg[off]));
+
+		if (probe_order[c].proto == RPC_PING_TCP) {
+			probe_connect(sock, &hosts[i], ntohl(msg[off]), xid);
+			continue;
+		}
+
+		hosts[i].addr.sin_port = htons(ntohl(msg[off]));
+		hosts[i].stage = PROBE_NULL;
+		hosts[i].retrans = PROBE_RETRANS_MIN;
+		probe_send(sock, &hosts[i], xid);
+	}
+}
+
+/*
+ * Decide if we know enough. Done once the lowest weight still in
+ * play has answered, or once any host has and the soft deadline
+ * has passed. With all set we wait for every host up to the soft
+ * deadline instead.
+ */
+static int probe_finished(struct rpc_probe *hosts, int count,
+			  int all, int soft_passed)
+{
+	int alive = 0, pending = 0;
+	int alive_min = INT_MAX, pending_min = INT_MAX;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (hosts[i].status) {
+			alive++;
+			if (hosts[i].weight < alive_min)
+				alive_min = hosts[i].weight;
+		} else if (hosts[i].stage != PROBE_DONE) {
+			pending++;
+			if (hosts[i].weight < pending_min)
+				pending_min = hosts[i].weight;
+		}
+	}
+
+	if (!pending)
+		return 1;
+
+	if (alive && soft_passed)
+		return 1;
+
+	return !all && alive && alive_min <= pending_min;
+}
+
+static int probe_hosts(struct rpc_probe *hosts, int count,
+		       long soft_ms, long hard_ms, int all, int sweep)
+{
+	struct pollfd *pfd;
+	struct sockaddr_in laddr;
+	unsigned long xid;
+	long start, now, wait, pmap_wait;
+	unsigned int status;
+	int sock, nfds, alive, timed_out, i, j;
+
+	pfd = alloca((count + 1) * sizeof(struct pollfd));
+
+	sock = socket(PF_INET, SOCK_DGRAM, IPPROTO_UDP);
+	if (sock < 0)
+		return 0;
+
+	/* Any port will do, don't use up reserved ones */
+	memset(&laddr, 0, sizeof(laddr));
+	laddr.sin_family = AF_INET;
+	laddr.sin_addr.s_addr = htonl(INADDR_ANY);
+	bind(sock, (struct sockaddr *) &laddr, sizeof(laddr));
+
+	start = probe_now();
+	xid = (getpid() << 16) ^ start;
+
+	pmap_wait = hard_ms / PROBE_PMAP_SHARE;
+	if (pmap_wait < PROBE_PMAP_MIN)
+		pmap_wait = PROBE_PMAP_MIN;
+
+	for (i = 0; i < count; i++) {
+		struct rpc_probe *h = &hosts[i];
+
+		status = sweep ? h->status : server_status(h->host);
+
+		h->status = 0;
+		h->time = 0;
+		h->pmap_time = 0;
+		h->sock = -1;
+		h->try = -1;
+		h->first = -1;
+		h->cached = 0;
+		h->sweep = sweep;
+		h->stage = PROBE_GETPORT;
+
+		/*
+		 * The portmapped entry comes first, the one on 2049 is
+		 * only tried in its turn once that has failed.
+		 */
+		for (j = 0; status && j < PROBE_TRIES; j++) {
+			if ((probe_order[j].vers | probe_order[j].proto) == status) {
+				h->first = j;
+				break;
+			}
+		}
+		if (sweep && h->first < 0) {
+			h->stage = PROBE_DONE;
+			continue;
+		}
+
+		memset(&h->addr, 0, sizeof(h->addr));
+		if (!(sweep ? server_resolve_direct(h->host, &h->addr.sin_addr, 1) :
+			      server_resolve(h->host, &h->addr.sin_addr, 1))) {
+			h->stage = PROBE_DONE;
+			continue;
+		}
+		h->addr.sin_family = AF_INET;
+
+		probe_next(sock, h, &xid);
+	}
+
+	while (1) {
+		now = probe_now();
+
+		if (probe_finished(hosts, count, all, now - start >= soft_ms) ||
+		    now - start >= hard_ms)
+			break;
+
+		wait = hard_ms - (now - start);
+		if (now - start < soft_ms && soft_ms - (now - start) < wait)
+			wait = soft_ms - (now - start);
+
+		pfd[0].fd = sock;
+		pfd[0].events = POLLIN;
+		nfds = 1;
+
+		for (i = 0; i < count; i++) {
+			struct rpc_probe *h = &hosts[i];
+
+			long due;
+
+			if (h->stage == PROBE_DONE)
+				continue;
+
+			if (h->stage == PROBE_CONNECT ||
+			    h->stage == PROBE_TCPNULL) {
+				pfd[nfds].fd = h->sock;
+				pfd[nfds].events = h->stage == PROBE_CONNECT ?
+							POLLOUT : POLLIN;
+				nfds++;
+				due = h->sent + PROBE_TCP_WAIT - now;
+			} else {
+				due = h->sent + h->retrans - now;
+				if (probe_pmap_direct(h) &&
+				    h->asked + pmap_wait - now < due)
+					due = h->asked + pmap_wait - now;
+			}
+
+			if (due < wait)
+				wait = due > 0 ? due : 0;
+		}
+
+		if (poll(pfd, nfds, wait) < 0 && errno != EINTR)
+			break;
+
+		if (pfd[0].revents & POLLIN)
+			probe_recv(sock, hosts, count, &xid);
+
+		for (i = 1; i < nfds; i++) {
+			struct rpc_probe *h;
+			socklen_t len;
+			int j, err;
+
+			if (!pfd[i].revents)
+				continue;
+
+			for (j = 0; j < count; j++)
+				if (hosts[j].sock == pfd[i].fd)
+					break;
+			if (j == count)
+				continue;
+			h = &hosts[j];
+
+			if (h->stage == PROBE_TCPNULL) {
+				probe_tcp_recv(sock, h, &xid);
+				continue;
+			}
+
+			len = sizeof(err);
+			if (getsockopt(h->sock, SOL_SOCKET,
+				       SO_ERROR, &err, &len) < 0)
+				err = errno;
+
+			if (err) {
+				probe_uncache(h);
+				probe_next(sock, h, &xid);
+			} else
+				probe_tcp_send(sock, h, &xid);
+		}
+
+		/* Resend anything that has gone unanswered too long */
+		now = probe_now();
+		for (i = 0; i < count; i++) {
+			struct rpc_probe *h = &hosts[i];
+
+			/* No connection or no reply on it, try the next way */
+			if (h->stage == PROBE_CONNECT ||
+			    h->stage == PROBE_TCPNULL) {
+				if (now - h->sent >= PROBE_TCP_WAIT) {
+					probe_uncache(h);
+					probe_next(sock, h, &xid);
+				}
+				continue;
+			}
+
+			if (h->stage != PROBE_GETPORT && h->stage != PROBE_NULL)
+				continue;
+
+			/* No portmapper, see if NFS is where it usually is */
+			if (probe_pmap_direct(h) && now - h->asked >= pmap_wait) {
+				h->try = PROBE_DIRECT - 1;
+				probe_next(sock, h, &xid);
+				continue;
+			}
+
+			if (now - h->sent < h->retrans)
+				continue;
+
+			/* A cached port gets one chance, then we ask again */
+			if (h->cached) {
+				probe_uncache(h);
+				h->stage = PROBE_GETPORT;
+				h->retrans = PROBE_RETRANS_MIN;
+				probe_send(sock, h, &xid);
+				continue;
+			}
+
+			h->retrans *= 2;
+			if (h->retrans > PROBE_RETRANS_MAX)
+				h->retrans = PROBE_RETRANS_MAX;
+			probe_send(sock, h, &xid);
+		}
+	}
+
+	/* Hosts still in play when we stopped early tell us nothing */
+	timed_out = probe_now() - start >= hard_ms;
+
+	alive = 0;
+	for (i = 0; i < count; i++) {
+		struct rpc_probe *h = &hosts[i];
+
+		if (h->sock >= 0) {
+			close(h->sock);
+			h->sock = -1;
+		}
+
+		if (h->status)
+			alive++;
+
+		if (sweep)
+			continue;
+
+		if (h->status)
+			server_update(h->host, h->status, h->time);
+		else if (h->stage == PROBE_DONE || timed_out)
+			server_update(h->host, 0, 0);
+	}
+	close(sock);
+
+	return alive;
+}
+
+/*
+ * Probe count hosts at once. Returns when the preferred host (see
+ * probe_finished()) is known, soft_ms after the start if any host
+ * has answered, or at hard_ms regardless. Each host's status and
+ * time are set if it answered, and what was learnt is recorded in
+ * the server table. Returns the number that answered.
+ */
+int rpc_probe(struct rpc_probe *hosts, int count,
+	      long soft_ms, long hard_ms, int all)
+{
+	return probe_hosts(hosts, count, soft_ms, hard_ms, all, 0);
+}
+
+/*
+ * Time one version and transport per host, the RPC_PING_* pair given
+ * in its status, always asking the portmapper where there is one. The
+ * same host may come more than once. Nothing is retried another way
+ * and the server table is left alone. Each status is left as it came
+ * if that answered, time and pmap_time with the round trips of the
+ * NULL call and the GETPORT. Returns the number that answered.
+ */
+int rpc_sweep(struct rpc_probe *hosts, int count, long timeout_ms)
+{
+	return probe_hosts(hosts, count, timeout_ms, timeout_ms, 1, 1);
 }
-#endif
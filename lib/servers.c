@@ -0,0 +1,805 @@
+#ident "$Id$"
+/* ----------------------------------------------------------------------- *
+ *
+ *  servers.c - host-wide table of NFS server health
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, Inc., 675 Mass Ave, Cambridge MA 02139,
+ *   USA; either version 2 of the License, or (at your option) any later
+ *   version; incorporated herein by reference.
+ *
+ *   The table is a file mapped shared by every automount process on
+ *   the host, and by all their children. Writers serialize on a byte
+ *   lock per entry and bump a sequence count around the update so
+ *   readers, who take no locks, can tell when they raced one.
+ *
+ *   It also caches what server names resolve to, so a mount that pings
+ *   and checks the locality of the same replicas doesn't go to NSS for
+ *   each of them every time, from a child that would forget the answer.
+ *
+ * ----------------------------------------------------------------------- */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <linux/nfs2.h>
+#include <linux/nfs3.h>
+
+#include "automount.h"
+
+#define SRV_MAGIC	0x61667336	/* "afs6" */
+#define SRV_SLOTS	1024
+#define SRV_NAMELEN	64
+#define SRV_COMBOS	5	/* NFS v2/v3 over UDP/TCP, v4 over TCP */
+#define SRV_WINDOW	16	/* Slots searched for a name before evicting */
+
+#define SRV_DEAD_FAILS	3	/* Failures in a row before we give up */
+#define SRV_DEAD_TIME	60	/* Seconds a dead server is left alone */
+#define SRV_FRESH_TIME	30	/* Seconds a probe result is trusted */
+#define SRV_IDLE_TIME	3600	/* Stop probing servers unused this long */
+#define SRV_PROBE_TOUT	5000	/* ms the prober waits for answers */
+#define SRV_RTT_WEIGHT	4	/* EWMA: rtt += (sample - rtt) / weight */
+#define SRV_PORT_TTL	300	/* Seconds a port or capability is trusted */
+#define SRV_NAME_TTL	300	/* Seconds an address lookup is trusted */
+#define SRV_NONAME_TTL	30	/* Seconds a failed lookup is trusted */
+#define SRV_BACKOFF_MIN	1000	/* ms, first wait before retrying a mount */
+#define SRV_BACKOFF_IDLE 300	/* Seconds after which a backoff is forgotten */
+
+/* Byte locks in the table header */
+#define SRV_LOCK_INIT	0
+#define SRV_LOCK_PROBER	1
+
+/*
+ * Mount slots are byte locks past the end of the table, the host-wide
+ * ones first and then SRV_MOUNTS for each entry.
+ */
+#define SRV_MOUNTS	4	/* Mounts at once from one server */
+#define SRV_MOUNTS_ALL	16	/* Mounts at once from all servers */
+#define SRV_QUEUE_TIME	10	/* Seconds to wait for a slot */
+#define SRV_QUEUE_POLL	20	/* ms between looks, plus up to as much again */
+#define SRV_SLOT_BASE	sizeof(struct srv_table)
+#define SRV_SLOT_ENTRY(i) \
+	(SRV_SLOT_BASE + SRV_MOUNTS_ALL + (off_t) (i) * SRV_MOUNTS)
+
+struct srv_entry {
+	volatile unsigned int seq;	/* Odd while being updated */
+	char name[SRV_NAMELEN];
+	unsigned int status;		/* RPC_PING_* that last answered */
+	long rtt;			/* Smoothed round trip, usecs */
+	time_t last_ok;
+	time_t last_fail;
+	time_t last_used;		/* Last asked about by a mount */
+	unsigned int failures;		/* Failures since last answer */
+	time_t mount_fail;		/* Last time a mount from it failed */
+	long backoff;			/* ms before retrying a mount, 0 none */
+	time_t backoff_time;		/* When backoff last grew */
+	unsigned int caps;		/* Combinations that have answered */
+	unsigned short port[SRV_COMBOS];	/* From GETPORT, 0 unknown */
+	time_t port_time[SRV_COMBOS];
+	struct in_addr addr[SERVER_MAX_ADDRS];
+	unsigned int naddrs;		/* 0 if the name didn't resolve */
+	time_t resolved;		/* When it was looked up, 0 never */
+};
+
+struct srv_table {
+	unsigned int magic;
+	unsigned int slots;
+	struct srv_entry ent[SRV_SLOTS];
+};
+
+static struct srv_table *table = NULL;
+static int table_fd = -1;
+static int table_failed = 0;
+
+/*
+ * Process associated locks on purpose: children share our open of
+ * the table, and each must exclude the others.
+ */
+static int table_lock(off_t off, short type, int wait)
+{
+	struct flock fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = off;
+	fl.l_len = 1;
+
+	while (fcntl(table_fd, wait ? F_SETLKW : F_SETLK, &fl) == -1) {
+		if (errno != EINTR || !wait)
+			return -1;
+	}
+	return 0;
+}
+
+static int table_open(void)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	if (table)
+		return 1;
+	if (table_failed)
+		return 0;
+	table_failed = 1;
+
+	fd = open(SERVER_TABLE, O_RDWR | O_CREAT, 0644);
+	if (fd < 0) {
+		debug("table_open: can't open %s: %m", SERVER_TABLE);
+		return 0;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	table_fd = fd;
+
+	table_lock(SRV_LOCK_INIT, F_WRLCK, 1);
+
+	if (fstat(fd, &st) == -1 ||
+	    (st.st_size < sizeof(struct srv_table) &&
+	     ftruncate(fd, sizeof(struct srv_table)) == -1)) {
+		error("table_open: can't size %s: %m", SERVER_TABLE);
+		goto fail;
+	}
+
+	map = mmap(NULL, sizeof(struct srv_table),
+		   PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		error("table_open: can't map %s: %m", SERVER_TABLE);
+		goto fail;
+	}
+	table = map;
+
+	if (table->magic != SRV_MAGIC || table->slots != SRV_SLOTS) {
+		memset(table, 0, sizeof(struct srv_table));
+		table->slots = SRV_SLOTS;
+		table->magic = SRV_MAGIC;
+	}
+
+	table_lock(SRV_LOCK_INIT, F_UNLCK, 0);
+	table_failed = 0;
+
+	return 1;
+
+fail:
+	close(fd);
+	table_fd = -1;
+	return 0;
+}
+
+static off_t entry_offset(struct srv_entry *e)
+{
+	return (char *) e - (char *) table;
+}
+
+static void entry_begin(struct srv_entry *e)
+{
+	table_lock(entry_offset(e), F_WRLCK, 1);
+	/* A writer that died half way leaves the count odd */
+	e->seq += (e->seq & 1) ? 2 : 1;
+	__sync_synchronize();
+}
+
+static void entry_end(struct srv_entry *e)
+{
+	__sync_synchronize();
+	e->seq++;
+	table_lock(entry_offset(e), F_UNLCK, 0);
+}
+
+/* entry_begin(), unless the slot was given to another server meanwhile */
+static int entry_lock(struct srv_entry *e, const char *host)
+{
+	entry_begin(e);
+	if (strcmp(e->name, host)) {
+		entry_end(e);
+		return 0;
+	}
+	return 1;
+}
+
+/* Returns 0 if the slot was given to another server meanwhile */
+static int entry_read(struct srv_entry *e, const char *host,
+		      struct server_info *info)
+{
+	unsigned int seq;
+	int tries = 0;
+	int same;
+
+	do {
+		seq = e->seq;
+		__sync_synchronize();
+		same = !strncmp(e->name, host, SRV_NAMELEN);
+		info->status = e->status;
+		info->rtt = (double) e->rtt / 1000000;
+		info->last_ok = e->last_ok;
+		info->last_fail = e->last_fail;
+		info->failures = e->failures;
+		info->mount_fail = e->mount_fail;
+		info->caps = e->caps;
+		__sync_synchronize();
+	} while ((seq & 1 || seq != e->seq) && ++tries < 100);
+
+	return same;
+}
+
+static unsigned int name_hash(const char *name)
+{
+	unsigned int hash = 0;
+
+	while (*name)
+		hash = hash * 31 + (unsigned char) *name++;
+
+	return hash % SRV_SLOTS;
+}
+
+/*
+ * A server lives in one of the SRV_WINDOW slots following its hash.
+ * When they are all taken, the one least recently asked about is
+ * given up to make room.
+ */
+static struct srv_entry *table_find(const char *host, int create)
+{
+	struct srv_entry *e, *oldest = NULL;
+	unsigned int hash, i;
+
+	if (!table_open() || strlen(host) >= SRV_NAMELEN)
+		return NULL;
+
+	hash = name_hash(host);
+
+	for (i = 0; i < SRV_WINDOW; i++) {
+		e = &table->ent[(hash + i) % SRV_SLOTS];
+
+		if (!e->name[0]) {
+			if (!create)
+				return NULL;
+
+			entry_begin(e);
+			if (!e->name[0])
+				strcpy(e->name, host);
+			entry_end(e);
+		}
+
+		if (!strcmp(e->name, host))
+			return e;
+
+		if (!oldest || e->last_used < oldest->last_used)
+			oldest = e;
+	}
+
+	if (!create)
+		return NULL;
+
+	e = oldest;
+	entry_begin(e);
+	debug("table_find: %s replaces %s", host, e->name);
+	memset((char *) e + sizeof(e->seq), 0, sizeof(*e) - sizeof(e->seq));
+	strcpy(e->name, host);
+	entry_end(e);
+
+	return e;
+}
+
+/*
+ * What we know about a server. Returns 0 if it has never been heard
+ * of, or the table is not available.
+ */
+int server_lookup(const char *host, struct server_info *info)
+{
+	struct srv_entry *e;
+
+	e = table_find(host, 0);
+	if (!e)
+		return 0;
+
+	e->last_used = time(NULL);
+
+	return entry_read(e, host, info);
+}
+
+/* Slot for an NFS version and transport, -1 if we don't keep it */
+static int combo(unsigned int vers, unsigned int proto)
+{
+	int i;
+
+	if (vers == RPC_PING_V4)
+		return proto == RPC_PING_TCP ? 4 : -1;
+	else if (vers == RPC_PING_V3)
+		i = 0;
+	else if (vers == RPC_PING_V2)
+		i = 1;
+	else
+		return -1;
+
+	return proto == RPC_PING_TCP ? i + 2 : i;
+}
+
+/* Record a probe of a server, status 0 if it didn't answer */
+void server_update(const char *host, unsigned int status, double rtt)
+{
+	struct srv_entry *e;
+	time_t now = time(NULL);
+
+	e = table_find(host, 1);
+	if (!e || !entry_lock(e, host))
+		return;
+
+	if (status) {
+		long sample = rtt * 1000000;
+
+		if (!e->last_ok)
+			e->rtt = sample;
+		else
+			e->rtt += (sample - e->rtt) / SRV_RTT_WEIGHT;
+		e->status = status;
+		e->last_ok = now;
+		e->failures = 0;
+		if (combo(status & 0xff, status & 0xff00) >= 0)
+			e->caps |= 1 << combo(status & 0xff, status & 0xff00);
+	} else {
+		e->last_fail = now;
+		e->failures++;
+	}
+	if (!e->last_used)
+		e->last_used = now;
+	entry_end(e);
+}
+
+/*
+ * Has the server failed to answer probes often and recently enough
+ * not to bother? Failed mounts don't count, see server_mount_failed().
+ */
+int server_dead(const char *host)
+{
+	struct server_info info;
+
+	if (!server_lookup(host, &info))
+		return 0;
+
+	return info.failures >= SRV_DEAD_FAILS &&
+		time(NULL) - info.last_fail < SRV_DEAD_TIME;
+}
+
+/*
+ * Did a mount from the server fail lately? Only a reason to prefer
+ * other replicas, the error may have been the export's, not the
+ * server's.
+ */
+int server_mount_failed(const char *host)
+{
+	struct server_info info;
+
+	if (!server_lookup(host, &info))
+		return 0;
+
+	return time(NULL) - info.mount_fail < SRV_DEAD_TIME;
+}
+
+/*
+ * A mount from the server failed. It may well still answer pings, so
+ * this is kept apart from the probe failures the prober can clear.
+ */
+void server_failed(const char *host)
+{
+	struct srv_entry *e;
+
+	e = table_find(host, 1);
+	if (!e || !entry_lock(e, host))
+		return;
+
+	e->mount_fail = time(NULL);
+	entry_end(e);
+}
+
+/* Is there a recent enough answer from the server to go on? */
+int server_fresh(const char *host, struct server_info *info)
+{
+	if (!server_lookup(host, info))
+		return 0;
+
+	return info->last_ok >= info->last_fail &&
+		time(NULL) - info->last_ok < SRV_FRESH_TIME;
+}
+
+/*
+ * Version and transport that last answered, if that was recently
+ * enough to be worth trying first. 0 if there is nothing to go on.
+ */
+unsigned int server_status(const char *host)
+{
+	struct server_info info;
+	int c;
+
+	if (!server_lookup(host, &info))
+		return 0;
+
+	if (info.last_ok < info.last_fail ||
+	    time(NULL) - info.last_ok >= SRV_PORT_TTL)
+		return 0;
+
+	/* It has failed since */
+	c = combo(info.status & 0xff, info.status & 0xff00);
+	if (c < 0 || !(info.caps & (1 << c)))
+		return 0;
+
+	return info.status;
+}
+
+/* Cached NFS port for a version and transport, 0 if not known */
+unsigned short server_port(const char *host,
+			   unsigned int vers, unsigned int proto)
+{
+	struct srv_entry *e;
+	unsigned short port;
+	unsigned int seq;
+	int c = combo(vers, proto);
+	int tries = 0;
+
+	if (c < 0 || !(e = table_find(host, 0)))
+		return 0;
+
+	do {
+		seq = e->seq;
+		__sync_synchronize();
+		port = e->port[c];
+		if (time(NULL) - e->port_time[c] >= SRV_PORT_TTL ||
+		    strncmp(e->name, host, SRV_NAMELEN))
+			port = 0;
+		__sync_synchronize();
+	} while ((seq & 1 || seq != e->seq) && ++tries < 100);
+
+	return port;
+}
+
+/*
+ * Remember the port GETPORT gave for a version and transport, or
+ * forget it (and that the combination worked) with a port of 0.
+ */
+void server_set_port(const char *host, unsigned int vers,
+		     unsigned int proto, unsigned short port)
+{
+	struct srv_entry *e;
+	int c = combo(vers, proto);
+
+	if (c < 0 || !(e = table_find(host, port != 0)))
+		return;
+
+	if (!entry_lock(e, host))
+		return;
+	e->port[c] = port;
+	e->port_time[c] = time(NULL);
+	if (!port)
+		e->caps &= ~(1 << c);
+	entry_end(e);
+}
+
+/* Look a name up the slow way, all its addresses up to max */
+static int resolve(const char *host, struct in_addr *addrs, int max)
+{
+	struct hostent *hp;
+	int n;
+
+	hp = gethostbyname(host);
+	if (!hp || hp->h_addrtype != AF_INET) {
+		debug("resolve: %s: lookup failure", host);
+		return 0;
+	}
+
+	for (n = 0; n < max && hp->h_addr_list[n]; n++)
+		memcpy(&addrs[n], hp->h_addr_list[n], sizeof(struct in_addr));
+
+	return n;
+}
+
+static void entry_set_addrs(struct srv_entry *e, const char *host,
+			    struct in_addr *addrs, int n)
+{
+	if (!entry_lock(e, host))
+		return;
+	memcpy(e->addr, addrs, n * sizeof(struct in_addr));
+	e->naddrs = n;
+	e->resolved = time(NULL);
+	entry_end(e);
+}
+
+/*
+ * Addresses of a server, as many as fit in max. Returns how many
+ * there are, 0 if the name doesn't resolve. Lookups, good or bad,
+ * are kept in the table for everyone to use until they go stale.
+ */
+int server_resolve(const char *host, struct in_addr *addrs, int max)
+{
+	struct in_addr found[SERVER_MAX_ADDRS];
+	struct srv_entry *e;
+	unsigned int seq;
+	int tries = 0;
+	int same, n;
+	time_t resolved;
+
+	if (max < 1)
+		return 0;
+
+	if (inet_aton(host, &addrs[0]))
+		return 1;
+
+	e = table_find(host, 1);
+	if (e) {
+		do {
+			seq = e->seq;
+			__sync_synchronize();
+			same = !strncmp(e->name, host, SRV_NAMELEN);
+			resolved = e->resolved;
+			n = e->naddrs;
+			if (n > SERVER_MAX_ADDRS)
+				n = SERVER_MAX_ADDRS;
+			memcpy(found, e->addr, n * sizeof(struct in_addr));
+			__sync_synchronize();
+		} while ((seq & 1 || seq != e->seq) && ++tries < 100);
+
+		if (same && resolved &&
+		    time(NULL) - resolved < (n ? SRV_NAME_TTL : SRV_NONAME_TTL))
+			goto done;
+	}
+
+	n = resolve(host, found, SERVER_MAX_ADDRS);
+	if (e)
+		entry_set_addrs(e, host, found, n);
+done:
+	memcpy(addrs, found, (n < max ? n : max) * sizeof(struct in_addr));
+	return n;
+}
+
+/*
+ * The same straight from the resolver, for tools that must leave the
+ * table alone.
+ */
+int server_resolve_direct(const char *host, struct in_addr *addrs, int max)
+{
+	if (max < 1)
+		return 0;
+
+	if (inet_aton(host, &addrs[0]))
+		return 1;
+
+	return resolve(host, addrs, max);
+}
+
+/* Per process, so that children don't all pick the same numbers */
+static long jitter(long range)
+{
+	static unsigned int seed;
+	static pid_t seed_pid;
+
+	if (range <= 0)
+		return 0;
+
+	if (seed_pid != getpid()) {
+		struct timeval tv;
+
+		gettimeofday(&tv, NULL);
+		seed_pid = getpid();
+		seed = seed_pid ^ tv.tv_sec ^ tv.tv_usec;
+	}
+
+	return rand_r(&seed) % (range + 1);
+}
+
+/*
+ * A mount from the server failed with an error worth retrying. Returns
+ * how many ms to wait before the retry, somewhere between half and all
+ * of a delay that doubles on each failure up to cap_ms. Every process
+ * on the host backs off from the same delay, so the more of us there
+ * are hammering a server the longer we all leave it.
+ */
+long server_backoff(const char *host, long cap_ms)
+{
+	struct srv_entry *e;
+	time_t now = time(NULL);
+	long delay;
+
+	e = table_find(host, 1);
+	if (!e || !entry_lock(e, host)) {
+		delay = SRV_BACKOFF_MIN;
+		goto out;
+	}
+
+	if (now - e->backoff_time > SRV_BACKOFF_IDLE)
+		e->backoff = 0;
+
+	delay = e->backoff ? e->backoff * 2 : SRV_BACKOFF_MIN;
+	if (delay > cap_ms)
+		delay = cap_ms;
+	e->backoff = delay;
+	e->backoff_time = now;
+	entry_end(e);
+out:
+	if (delay > cap_ms)
+		delay = cap_ms;
+	return delay - jitter(delay / 2);
+}
+
+/* A mount from the server worked, so ease off the backoff */
+void server_mount_ok(const char *host)
+{
+	struct srv_entry *e;
+
+	e = table_find(host, 0);
+	if (!e || (!e->backoff && !e->mount_fail))
+		return;
+
+	if (!entry_lock(e, host))
+		return;
+	e->backoff /= 2;
+	if (e->backoff < SRV_BACKOFF_MIN)
+		e->backoff = 0;
+	e->mount_fail = 0;
+	entry_end(e);
+}
+
+static off_t slot_held = -1;		/* Host-wide slot we hold */
+static off_t server_slot_held = -1;	/* Server slot we hold */
+
+/* Lock one of count slots from base, -1 if they are all taken */
+static off_t slot_take(off_t base, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (!table_lock(base + i, F_WRLCK, 0))
+			return base + i;
+	}
+	return -1;
+}
+
+/*
+ * About to mount from host: wait until there are fewer than
+ * SRV_MOUNTS mounts from it going on anywhere on the host, and fewer
+ * than SRV_MOUNTS_ALL altogether. The slots are byte locks, so the
+ * kernel gives them back if we die. After SRV_QUEUE_TIME we go ahead
+ * regardless rather than fail the mount.
+ */
+void server_mount_begin(const char *host)
+{
+	struct srv_entry *e;
+	time_t start = time(NULL);
+	int waited = 0;
+
+	server_mount_end();
+
+	e = table_find(host, 1);
+	if (!e)
+		return;
+
+	while (1) {
+		if (slot_held < 0)
+			slot_held = slot_take(SRV_SLOT_BASE, SRV_MOUNTS_ALL);
+		if (slot_held >= 0 && server_slot_held < 0)
+			server_slot_held = slot_take(
+					SRV_SLOT_ENTRY(e - table->ent), SRV_MOUNTS);
+		if (slot_held >= 0 && server_slot_held >= 0)
+			break;
+
+		if (time(NULL) - start >= SRV_QUEUE_TIME) {
+			warn("server_mount_begin: %s: no mount slot after %d "
+			     "secs, going ahead", host, SRV_QUEUE_TIME);
+			return;
+		}
+
+		if (!waited++)
+			debug("server_mount_begin: %s: waiting for a slot",
+			      host);
+
+		/* Don't sit on a host-wide slot while we wait for the server */
+		if (slot_held >= 0) {
+			table_lock(slot_held, F_UNLCK, 0);
+			slot_held = -1;
+		}
+
+		usleep((SRV_QUEUE_POLL + jitter(SRV_QUEUE_POLL)) * 1000);
+	}
+
+	if (waited)
+		debug("server_mount_begin: %s: got a slot after %d secs",
+		      host, (int) (time(NULL) - start));
+}
+
+/* The mount server_mount_begin() was for is over */
+void server_mount_end(void)
+{
+	if (server_slot_held >= 0) {
+		table_lock(server_slot_held, F_UNLCK, 0);
+		server_slot_held = -1;
+	}
+	if (slot_held >= 0) {
+		table_lock(slot_held, F_UNLCK, 0);
+		slot_held = -1;
+	}
+}
+
+/*
+ * Background prober, returns only once our automount has gone. Every
+ * interval the servers mounts have asked about lately are probed,
+ * results going into the table through rpc_probe(). Names about to go
+ * stale are looked up again first, so that mounts seldom have to wait
+ * on the resolver themselves. Only one process
+ * on the host does the work at a time, the rest wait their turn on
+ * the prober lock.
+ */
+void server_prober(time_t interval)
+{
+	struct rpc_probe *hosts;
+	char (*names)[SRV_NAMELEN];
+	int have_lock = 0;
+	time_t now;
+	int count, i;
+
+	hosts = malloc(SRV_SLOTS * sizeof(struct rpc_probe));
+	names = malloc(SRV_SLOTS * SRV_NAMELEN);
+	if (!hosts || !names) {
+		error("server_prober: malloc: %m");
+		free(hosts);
+		free(names);
+		return;
+	}
+
+	while (1) {
+		sleep(interval);
+
+		/* Our automount went away */
+		if (getppid() == 1)
+			break;
+
+		if (!table_open())
+			continue;
+
+		if (!have_lock) {
+			if (table_lock(SRV_LOCK_PROBER, F_WRLCK, 0))
+				continue;
+			have_lock = 1;
+			debug("server_prober: probing every %d secs",
+			      (int) interval);
+		}
+
+		now = time(NULL);
+		count = 0;
+		for (i = 0; i < SRV_SLOTS; i++) {
+			struct srv_entry *e = &table->ent[i];
+
+			if (!e->name[0] || now - e->last_used > SRV_IDLE_TIME)
+				continue;
+
+			/* The slot may be reused while we are at it */
+			strncpy(names[count], e->name, SRV_NAMELEN);
+			names[count][SRV_NAMELEN - 1] = '\0';
+
+			if (now - e->resolved >= SRV_NAME_TTL / 2) {
+				struct in_addr addrs[SERVER_MAX_ADDRS];
+				int n;
+
+				n = resolve(names[count], addrs, SERVER_MAX_ADDRS);
+				entry_set_addrs(e, names[count], addrs, n);
+			}
+
+			hosts[count].host = names[count];
+			hosts[count].weight = INT_MAX;
+			count++;
+		}
+
+		if (count)
+			rpc_probe(hosts, count,
+				  SRV_PROBE_TOUT, SRV_PROBE_TOUT, 1);
+	}
+
+	free(hosts);
+	free(names);
+}
@@ -0,0 +1,467 @@
+#ident "$Id$"
+/* ----------------------------------------------------------------------- *
+ *
+ *  lookup_hosts.c - module for Linux automount to mount the exports
+ *                   of any NFS server, the -hosts map
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, Inc., 675 Mass Ave, Cambridge MA 02139,
+ *   USA; either version 2 of the License, or (at your option) any later
+ *   version; incorporated herein by reference.
+ *
+ *   The key is a server name, the entry a multi-mount of everything it
+ *   exports, as samples/auto.net makes with showmount. The export list
+ *   is asked for over MOUNTPROC_EXPORT and kept in the map cache for
+ *   HOSTS_TTL seconds. Lookups happen in a child of the daemon, so a
+ *   child that had to ask sends the daemon a HUP. The daemon itself
+ *   never talks to the servers: it forks a refresher for every server
+ *   with a directory in the root whose list is out of date, and takes
+ *   in what that sends back over a pipe on a later HUP. Servers that
+ *   are known are ghosted.
+ *
+ * ----------------------------------------------------------------------- */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <malloc.h>
+#include <alloca.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#define MODULE_LOOKUP
+#include "automount.h"
+#include "listmount.h"
+
+#define MAPFMT_DEFAULT "sun"
+
+#define MODPREFIX "lookup(hosts): "
+
+/* What samples/auto.net puts in front of each entry */
+#define HOSTS_OPTIONS	"-fstype=nfs,hard,intr,nodev,nosuid"
+
+#define HOSTS_TTL	300	/* secs an export list is good for */
+#define HOSTS_FORGET	3600	/* secs before an unreachable server goes */
+#define HOSTS_PING_TOUT	2	/* secs for the portmapper to answer */
+#define HOSTS_PIPE_WAIT	1000	/* ms the refresher waits for the daemon to read */
+
+/* One record from the refresher, "server\0entry\0" */
+#define HOSTS_REC_MAX	(KEY_MAX_LEN + MAPENT_MAX_LEN + 2)
+
+struct lookup_context {
+	struct parse_mod *parse;
+
+	/* The refresher, if one is running */
+	int refresh_fd;
+	int refresh_len;
+	char refresh_buf[HOSTS_REC_MAX];
+};
+
+int lookup_version = AUTOFS_LOOKUP_VERSION;	/* Required by protocol */
+
+int lookup_init(const char *mapfmt, int argc, const char *const *argv, void **context)
+{
+	struct lookup_context *ctxt;
+
+	if (!(*context = ctxt = malloc(sizeof(struct lookup_context)))) {
+		crit(MODPREFIX "malloc: %m");
+		return 1;
+	}
+
+	if (ap.type == LKP_DIRECT) {
+		crit(MODPREFIX "hosts map can't be a direct map");
+		free(ctxt);
+		return 1;
+	}
+
+	ctxt->refresh_fd = -1;
+	ctxt->refresh_len = 0;
+
+	if (!mapfmt)
+		mapfmt = MAPFMT_DEFAULT;
+
+	/* No map name, all the arguments are for the parser */
+	return !(ctxt->parse = open_parse(mapfmt, MODPREFIX, argc, argv));
+}
+
+static int cmp_dir(const void *a, const void *b)
+{
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/*
+ * The multi-mount entry for everything host exports, NULL if it
+ * doesn't answer or exports nothing. Parents sort ahead of what is
+ * exported beneath them, so they are mounted first. Servers that
+ * answer neither the portmapper nor NFSv4 are noted in the server
+ * table, so that they are left alone for a while. Names that don't
+ * resolve are kept out of it.
+ */
+static char *host_mapent(const char *host)
+{
+	struct in_addr addr;
+	exports list, exl;
+	char **dirs;
+	char *mapent, *p;
+	int count, len, i;
+
+	if (server_dead(host)) {
+		debug(MODPREFIX "server %s marked dead", host);
+		return NULL;
+	}
+
+	if (!server_resolve_direct(host, &addr, 1)) {
+		debug(MODPREFIX "host %s not found", host);
+		return NULL;
+	}
+
+	if (!rpc_portmap_ping(host, HOSTS_PING_TOUT, 0)) {
+		/* It may be NFSv4 only, with no exports to list */
+		if (rpc_ping_v4(host, HOSTS_PING_TOUT, 0)) {
+			info(MODPREFIX "server %s has no portmapper", host);
+			return NULL;
+		}
+		info(MODPREFIX "server %s not responding", host);
+		server_update(host, 0, 0);
+		return NULL;
+	}
+
+	/* Failed or empty, neither is the server being down */
+	list = get_export_list((char *) host);
+	if (!list) {
+		info(MODPREFIX "no exports from %s", host);
+		return NULL;
+	}
+
+	count = 0;
+	for (exl = list; exl; exl = exl->ex_next)
+		count++;
+
+	dirs = alloca(count * sizeof(char *));
+	for (exl = list, count = 0; exl; exl = exl->ex_next) {
+		/* Nothing the parser can't take */
+		if (*exl->ex_dir != '/' || strpbrk(exl->ex_dir, " \t\n\"\\")) {
+			warn(MODPREFIX "export %s:%s skipped",
+			     host, exl->ex_dir);
+			continue;
+		}
+		dirs[count++] = exl->ex_dir;
+	}
+	qsort(dirs, count, sizeof(char *), cmp_dir);
+
+	mapent = malloc(MAPENT_MAX_LEN + 1);
+	if (!mapent) {
+		error(MODPREFIX "malloc: %m");
+		export_list_free(list);
+		return NULL;
+	}
+
+	p = mapent + sprintf(mapent, "%s", HOSTS_OPTIONS);
+	for (i = 0; i < count; i++) {
+		if (i && !strcmp(dirs[i], dirs[i - 1]))
+			continue;
+
+		len = 2 * strlen(dirs[i]) + strlen(host) + 3;
+		if (p - mapent + len > MAPENT_MAX_LEN) {
+			warn(MODPREFIX "too many exports from %s, "
+			     "only the first %d used", host, i);
+			break;
+		}
+		p += sprintf(p, " %s %s:%s", dirs[i], host, dirs[i]);
+	}
+
+	export_list_free(list);
+
+	if (p - mapent == strlen(HOSTS_OPTIONS)) {
+		free(mapent);
+		return NULL;
+	}
+
+	return mapent;
+}
+
+/* Take in what the refresher has sent so far */
+static void refresh_read(struct lookup_context *ctxt, const char *root)
+{
+	char *buf = ctxt->refresh_buf;
+	int n;
+
+	while (ctxt->refresh_fd >= 0) {
+		char *p, *end;
+
+		n = read(ctxt->refresh_fd, buf + ctxt->refresh_len,
+			 HOSTS_REC_MAX - ctxt->refresh_len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (n < 0 && errno == EAGAIN)
+				break;
+			/* Done, or gone */
+			close(ctxt->refresh_fd);
+			ctxt->refresh_fd = -1;
+			ctxt->refresh_len = 0;
+			break;
+		}
+		ctxt->refresh_len += n;
+
+		p = buf;
+		end = buf + ctxt->refresh_len;
+		for (;;) {
+			char *mapent, *next;
+
+			mapent = memchr(p, '\0', end - p);
+			if (!mapent)
+				break;
+			mapent++;
+			next = memchr(mapent, '\0', end - mapent);
+			if (!next)
+				break;
+
+			debug(MODPREFIX "refreshed %s", p);
+			cache_update(root, p, mapent, time(NULL));
+			p = next + 1;
+		}
+
+		/* Keep what's left of a record for next time */
+		ctxt->refresh_len = end - p;
+		memmove(buf, p, ctxt->refresh_len);
+
+		/* Never happens unless the refresher is broken */
+		if (ctxt->refresh_len == HOSTS_REC_MAX) {
+			error(MODPREFIX "bad record from refresher");
+			close(ctxt->refresh_fd);
+			ctxt->refresh_fd = -1;
+			ctxt->refresh_len = 0;
+		}
+	}
+}
+
+/*
+ * The refresher: ask each of the servers for its exports and hand the
+ * entries to the daemon, with a HUP so that it takes them in. It only
+ * writes as much as the pipe takes, so if that fills up it gives the
+ * daemon a HUP and a while to read.
+ */
+static void refresh_write(int fd, const char *buf, int len)
+{
+	struct pollfd pfd;
+	int n;
+
+	while (len > 0) {
+		n = write(fd, buf, len);
+		if (n > 0) {
+			buf += n;
+			len -= n;
+			continue;
+		}
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && errno != EAGAIN)
+			exit(1);	/* The daemon has gone */
+
+		kill(getppid(), SIGHUP);
+		pfd.fd = fd;
+		pfd.events = POLLOUT;
+		poll(&pfd, 1, HOSTS_PIPE_WAIT);
+	}
+}
+
+static void refresh(int fd, char **hosts, int count)
+{
+	int found = 0;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		char *mapent = host_mapent(hosts[i]);
+
+		if (!mapent)
+			continue;
+
+		refresh_write(fd, hosts[i], strlen(hosts[i]) + 1);
+		refresh_write(fd, mapent, strlen(mapent) + 1);
+		free(mapent);
+		found = 1;
+	}
+	close(fd);
+
+	/* Not if nothing came of it, else unreachable ones go round and round */
+	if (found)
+		kill(getppid(), SIGHUP);
+}
+
+/* Fork a refresher for the servers, unless one is still running */
+static void refresh_start(struct lookup_context *ctxt, char **hosts, int count)
+{
+	int pipefd[2];
+	pid_t f;
+
+	if (ctxt->refresh_fd >= 0 || !count)
+		return;
+
+	if (pipe(pipefd) < 0) {
+		error(MODPREFIX "pipe: %m");
+		return;
+	}
+
+	f = fork();
+	if (f < 0) {
+		error(MODPREFIX "fork: %m");
+		close(pipefd[0]);
+		close(pipefd[1]);
+		return;
+	}
+
+	if (!f) {
+		ignore_signals();
+		close(ap.pipefd);
+		close(ap.ioctlfd);
+		close(ap.state_pipe[0]);
+		close(ap.state_pipe[1]);
+		close(pipefd[0]);
+
+		fcntl(pipefd[1], F_SETFL,
+		      fcntl(pipefd[1], F_GETFL, 0) | O_NONBLOCK);
+		refresh(pipefd[1], hosts, count);
+		exit(0);
+	}
+
+	debug(MODPREFIX "refresher %d for %d servers", f, count);
+
+	close(pipefd[1]);
+	fcntl(pipefd[0], F_SETFD, FD_CLOEXEC);
+	fcntl(pipefd[0], F_SETFL, fcntl(pipefd[0], F_GETFL, 0) | O_NONBLOCK);
+	ctxt->refresh_fd = pipefd[0];
+	ctxt->refresh_len = 0;
+}
+
+/*
+ * Take in what a refresher has found, start one for servers with a
+ * directory in root whose export lists are out of date, and ghost
+ * what is known. Nothing here waits on a server.
+ */
+int lookup_ghost(const char *root, int ghost, time_t now, void *context)
+{
+	struct lookup_context *ctxt = (struct lookup_context *) context;
+	struct mapent_cache *me;
+	struct dirent *de;
+	char **hosts = NULL;
+	int count = 0, i;
+	DIR *dir;
+
+	now = time(NULL);
+
+	refresh_read(ctxt, root);
+
+	dir = opendir(root);
+	if (!dir) {
+		error(MODPREFIX "opendir %s: %m", root);
+		return LKP_INDIRECT;
+	}
+
+	while ((de = readdir(dir)) != NULL) {
+		char **tmp;
+
+		if (*de->d_name == '.')
+			continue;
+
+		me = cache_lookup(de->d_name);
+		if (me && now - me->age < HOSTS_TTL)
+			continue;
+
+		if (me && now - me->age >= HOSTS_FORGET) {
+			debug(MODPREFIX "forgetting %s", de->d_name);
+			cache_delete(root, de->d_name, ghost);
+		}
+
+		if (server_dead(de->d_name) || ctxt->refresh_fd >= 0)
+			continue;
+
+		tmp = realloc(hosts, (count + 1) * sizeof(char *));
+		if (!tmp || !(tmp[count] = strdup(de->d_name))) {
+			error(MODPREFIX "malloc: %m");
+			hosts = tmp ? tmp : hosts;
+			break;
+		}
+		hosts = tmp;
+		count++;
+	}
+	closedir(dir);
+
+	refresh_start(ctxt, hosts, count);
+
+	for (i = 0; i < count; i++)
+		free(hosts[i]);
+	free(hosts);
+
+	/* Nothing looked up yet is fine */
+	if (!cache_lookup_first())
+		return LKP_INDIRECT;
+
+	return cache_ghost(root, ghost, "hosts", "hosts", ctxt->parse);
+}
+
+int lookup_mount(const char *root, const char *name, int name_len, void *context)
+{
+	struct lookup_context *ctxt = (struct lookup_context *) context;
+	struct mapent_cache *me;
+	char key[KEY_MAX_LEN + 1];
+	char *mapent = NULL;
+	time_t now = time(NULL);
+	int need_hup = 0;
+	int ret;
+
+	if (name_len > KEY_MAX_LEN)
+		return 1;
+	memcpy(key, name, name_len);
+	key[name_len] = '\0';
+
+	debug(MODPREFIX "looking up %s", key);
+
+	me = cache_lookup(key);
+	if (!me || now - me->age >= HOSTS_TTL) {
+		mapent = host_mapent(key);
+		if (mapent) {
+			cache_update(root, key, mapent, now);
+			/* Have the daemon ask too, for the next lookup */
+			need_hup = 1;
+		} else if (!me) {
+			info(MODPREFIX "nothing to mount from %s", key);
+			return 1;
+		} else {
+			debug(MODPREFIX "using old export list of %s", key);
+		}
+	}
+
+	debug(MODPREFIX "%s -> %s", key, mapent ? mapent : me->mapent);
+
+	ret = ctxt->parse->parse_mount(root, name, name_len,
+				       mapent ? mapent : me->mapent,
+				       ctxt->parse->context);
+
+	if (mapent)
+		free(mapent);
+
+	if (need_hup)
+		kill(getppid(), SIGHUP);
+
+	return ret;
+}
+
+int lookup_done(void *context)
+{
+	struct lookup_context *ctxt = (struct lookup_context *) context;
+	int rv = close_parse(ctxt->parse);
+	/* A refresher finds the pipe closed and stops */
+	if (ctxt->refresh_fd >= 0)
+		close(ctxt->refresh_fd);
+	free(ctxt);
+	return rv;
+}
@@ -19,13 +19,19 @@
  */
 
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
 #include <ctype.h>
+#include <errno.h>
 #include <string.h>
 #include <syslog.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <time.h>
 #include <signal.h>
+#include <sys/time.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <netinet/in.h>
 #include <arpa/nameser.h>
 #include <resolv.h>
@@ -69,39 +75,93 @@ struct autofs_schema supported_schemas[NR_SCHEMAS] = {
 	{ "nisMap", "nisMapName", "nisObject", "cn", "nisMapEntry" },
 };
 
+#define LDAP_IDLE_TIMEOUT	300	/* secs before an unused connection is closed */
+#define LDAP_CHECK_IDLE		10	/* secs unused before a connection is checked */
+#define LDAP_NET_TOUT		8	/* secs to connect */
+#define LDAP_SEARCH_TOUT	10	/* secs for a search to finish */
+#define LDAP_RETRY_FAILED	60	/* secs a server that failed is tried last */
+#define LDAP_RTT_WEIGHT		4	/* smoothing of search times */
+#define LDAP_MAX_SERVERS	16
+#define LDAP_PAGE_SIZE		500	/* entries a map is read in */
+
+/*
+ * The server part of a map name may list several servers, "a,b,c",
+ * or name DNS SRV records, "_ldap._tcp.example.com". Whichever has
+ * answered searches fastest is connected to first; one that fails or
+ * is too slow to answer is left for the next.
+ */
+struct ldap_server {
+	char *host;		/* NULL for the ldap.conf default */
+	int port;
+	int prio;		/* SRV priority, lowest first, 0 if none */
+	long rtt;		/* smoothed search time, usecs, 0 unknown */
+	time_t failed;		/* when it last failed */
+};
+
+/*
+ * Connections are kept open from one query to the next and shared by
+ * every context on the same server, so the sources of a multi map use
+ * one between them. The helper closes its connection once it has gone
+ * LDAP_IDLE_TIMEOUT unused; the daemon, which only reads whole maps,
+ * closes its own once a map is read. Lookups run in children of the
+ * daemon, which inherit its connection but must leave it alone, the
+ * socket is the daemon's. A child opens its own and keeps it for the
+ * rest of its queries, but first asks the helper, see helper_start().
+ */
+struct ldap_conn {
+	char *server;
+	int port;
+	struct ldap_server servers[LDAP_MAX_SERVERS];
+	int nservers;
+	struct ldap_server *cur;	/* the one ldap is connected to */
+	pid_t owner;			/* process keeping the scores */
+	LDAP *ldap;
+	pid_t pid;		/* process that opened ldap */
+	time_t used;
+	int refs;
+	struct ldap_conn *next;
+};
+
+static struct ldap_conn *conns = NULL;
+
 struct lookup_context {
 	char *server, *base;
 	int port;
 
+	struct ldap_conn *conn;
+
+	/* how far below the base the map entries are */
+	int scope;
+
 	/* once we find a schema that works, save it for future lookups  -
-	 * unless the use_old_ldap_lookup optoin is in effect in which case every schema is search every time.
+	 * unless the use_old_ldap_lookup option is in effect in which case
+	 * it is looked for every time.
 	 */
 	struct autofs_schema *schema;
 
+	/* the daemon's helper for key lookups in its children */
+	int helper_fd;
+	pid_t helper_pid;
+
 	struct parse_mod *parse;
 };
 
 int lookup_version = AUTOFS_LOOKUP_VERSION;	/* Required by protocol */
 
-void set_schema(struct lookup_context *ctxt, struct autofs_schema *schema)
-{
-	if (!ap.use_old_ldap_lookup) 
-		ctxt->schema = schema;
-}
 
-
-static LDAP *do_connect(struct lookup_context *ctxt, int *result_ldap)
+static LDAP *do_connect(struct lookup_context *ctxt,
+			struct ldap_server *server, int *result_ldap)
 {
 	LDAP *ldap;
 	int version = 3;
-	int timeout = 8;
-	int rv;
+	struct timeval timeout;
+	int rv, fd;
 
 	/* Initialize the LDAP context. */
-	ldap = ldap_init(ctxt->server, ctxt->port);
+	ldap = ldap_init(server->host, server->port);
 	if (!ldap) {
 		crit(MODPREFIX "%s: couldn't initialize LDAP connection"
-		     " to %s", __func__, ctxt->server ? ctxt->server : "default server");
+		     " to %s", __func__, server->host ? server->host : "default server");
 		return NULL;
 	}
 
@@ -110,7 +170,7 @@ static LDAP *do_connect(struct lookup_context *ctxt, int *result_ldap)
 	if (rv != LDAP_SUCCESS) {
 		/* fall back to LDAPv2 */
 		ldap_unbind(ldap);
-		ldap = ldap_init(ctxt->server, ctxt->port);
+		ldap = ldap_init(server->host, server->port);
 		if (!ldap) {
 			crit(MODPREFIX "%s: couldn't initialize LDAP for v2", __func__ );
 			return NULL;
@@ -119,27 +179,1188 @@ static LDAP *do_connect(struct lookup_context *ctxt, int *result_ldap)
 		}
 	}
 
-	/* Sane network connection timeout */
-	rv = ldap_set_option(ldap, LDAP_OPT_NETWORK_TIMEOUT, &timeout);
-	if (rv != LDAP_SUCCESS) {
-		warn(MODPREFIX 
-		     "%s: failed to set connection timeout to %d", __func__, timeout);
+	/* Sane network connection timeout */
+	timeout.tv_sec = LDAP_NET_TOUT;
+	timeout.tv_usec = 0;
+	rv = ldap_set_option(ldap, LDAP_OPT_NETWORK_TIMEOUT, &timeout);
+	if (rv != LDAP_SUCCESS) {
+		warn(MODPREFIX 
+		     "%s: failed to set connection timeout to %d", __func__, LDAP_NET_TOUT);
+	}
+
+#ifdef LDAP_OPT_TIMEOUT
+	/* And for the bind to answer */
+	timeout.tv_sec = LDAP_SEARCH_TOUT;
+	ldap_set_option(ldap, LDAP_OPT_TIMEOUT, &timeout);
+#endif
+
+	/* Connect to the server as an anonymous user. */
+	if (version == 2)
+		rv = ldap_simple_bind_s(ldap, ctxt->base, NULL);
+	else
+		rv = ldap_simple_bind_s(ldap, NULL, NULL);
+
+	if (rv != LDAP_SUCCESS) {
+		crit(MODPREFIX "couldn't bind to %s",
+		     server->host ? server->host : "default server");
+		if (result_ldap)
+			*result_ldap = rv;
+		ldap_unbind(ldap);
+		return NULL;
+	}
+
+	/* Not for the mount commands we run */
+	if (ldap_get_option(ldap, LDAP_OPT_DESC, &fd) == LDAP_SUCCESS)
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	return ldap;
+}
+
+static struct ldap_conn *conn_find(const char *server, int port)
+{
+	struct ldap_conn *conn;
+
+	for (conn = conns; conn; conn = conn->next) {
+		if (conn->port != port)
+			continue;
+		if (!server && !conn->server)
+			return conn;
+		if (server && conn->server && !strcmp(server, conn->server))
+			return conn;
+	}
+
+	return NULL;
+}
+
+/* The servers named by SRV records, by priority, then weight */
+static int srv_lookup(struct ldap_conn *conn, const char *name)
+{
+	unsigned char answer[NS_MAXMSG];
+	int weight[LDAP_MAX_SERVERS];
+	ns_msg msg;
+	ns_rr rr;
+	int len, i, j;
+
+	len = res_query(name, C_IN, T_SRV, answer, sizeof(answer));
+	if (len < 0 || ns_initparse(answer, len, &msg) < 0) {
+		error(MODPREFIX "no SRV records for %s", name);
+		return 0;
+	}
+
+	for (i = 0; i < ns_msg_count(msg, ns_s_an); i++) {
+		char host[NS_MAXDNAME];
+		const unsigned char *rd;
+		int p, w, port;
+
+		if (ns_parserr(&msg, ns_s_an, i, &rr) < 0)
+			break;
+		if (ns_rr_type(rr) != ns_t_srv || ns_rr_rdlen(rr) < 7)
+			continue;
+
+		rd = ns_rr_rdata(rr);
+		p = ns_get16(rd);
+		w = ns_get16(rd + 2);
+		port = ns_get16(rd + 4);
+		if (dn_expand(ns_msg_base(msg), ns_msg_end(msg),
+			      rd + 6, host, sizeof(host)) < 0)
+			continue;
+
+		/* "." says there is no such service */
+		if (!*host || !strcmp(host, "."))
+			continue;
+
+		for (j = conn->nservers; j > 0; j--) {
+			if (conn->servers[j - 1].prio < p ||
+			    (conn->servers[j - 1].prio == p &&
+			     weight[j - 1] >= w))
+				break;
+		}
+		if (j == LDAP_MAX_SERVERS)
+			continue;
+
+		if (conn->nservers == LDAP_MAX_SERVERS)
+			free(conn->servers[--conn->nservers].host);
+		memmove(&conn->servers[j + 1], &conn->servers[j],
+			(conn->nservers - j) * sizeof(struct ldap_server));
+		memmove(&weight[j + 1], &weight[j], (conn->nservers - j) * sizeof(int));
+
+		memset(&conn->servers[j], 0, sizeof(struct ldap_server));
+		conn->servers[j].host = strdup(host);
+		if (!conn->servers[j].host) {
+			crit(MODPREFIX "malloc: %m");
+			return 0;
+		}
+		conn->servers[j].port = port;
+		conn->servers[j].prio = p;
+		weight[j] = w;
+		conn->nservers++;
+
+		debug(MODPREFIX "%s: %s port %d priority %d weight %d",
+		      name, host, port, p, w);
+	}
+
+	if (!conn->nservers) {
+		error(MODPREFIX "no servers in SRV records for %s", name);
+		return 0;
+	}
+
+	return 1;
+}
+
+static void conn_free(struct ldap_conn *conn)
+{
+	int i;
+
+	for (i = 0; i < conn->nservers; i++) {
+		if (conn->servers[i].host)
+			free(conn->servers[i].host);
+	}
+	if (conn->server)
+		free(conn->server);
+	free(conn);
+}
+
+/* A connection for the server or servers of ctxt, not yet open */
+static struct ldap_conn *conn_new(struct lookup_context *ctxt)
+{
+	struct ldap_conn *conn;
+	char *list, *host, *save;
+
+	conn = malloc(sizeof(struct ldap_conn));
+	if (!conn) {
+		crit(MODPREFIX "malloc: %m");
+		return NULL;
+	}
+	memset(conn, 0, sizeof(struct ldap_conn));
+	conn->port = ctxt->port;
+	conn->owner = getpid();
+
+	if (ctxt->server) {
+		conn->server = strdup(ctxt->server);
+		if (!conn->server) {
+			crit(MODPREFIX "malloc: %m");
+			conn_free(conn);
+			return NULL;
+		}
+	}
+
+	if (ctxt->server && *ctxt->server == '_') {
+		if (!srv_lookup(conn, ctxt->server)) {
+			conn_free(conn);
+			return NULL;
+		}
+	} else if (ctxt->server) {
+		list = alloca(strlen(ctxt->server) + 1);
+		strcpy(list, ctxt->server);
+
+		for (host = strtok_r(list, ",", &save);
+		     host && conn->nservers < LDAP_MAX_SERVERS;
+		     host = strtok_r(NULL, ",", &save)) {
+			struct ldap_server *server = &conn->servers[conn->nservers];
+
+			server->host = strdup(host);
+			if (!server->host) {
+				crit(MODPREFIX "malloc: %m");
+				conn_free(conn);
+				return NULL;
+			}
+			server->port = ctxt->port;
+			conn->nservers++;
+		}
+	}
+
+	/* The one in ldap.conf */
+	if (!conn->nservers) {
+		conn->servers[0].port = ctxt->port;
+		conn->nservers = 1;
+	}
+
+	conn->next = conns;
+	conns = conn;
+
+	return conn;
+}
+
+static void conn_close(struct ldap_conn *conn)
+{
+	if (!conn->ldap)
+		return;
+
+	/* Someone else's, just forget it */
+	if (conn->pid == getpid())
+		ldap_unbind(conn->ldap);
+	conn->ldap = NULL;
+	conn->cur = NULL;
+}
+
+/*
+ * A connection nothing was asked on should have nothing to read. If
+ * it has, the server closed it or told us it is about to.
+ */
+static int conn_alive(struct ldap_conn *conn)
+{
+	struct pollfd pfd;
+	int fd;
+
+	if (ldap_get_option(conn->ldap, LDAP_OPT_DESC, &fd) != LDAP_SUCCESS)
+		return 0;
+
+	pfd.fd = fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	if (poll(&pfd, 1, 0) < 0)
+		return 0;
+
+	return !(pfd.revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL));
+}
+
+/*
+ * Should a be tried before b? Servers that haven't failed lately go
+ * first, those of the lowest SRV priority first, and within that the
+ * fastest first. Those not yet timed come after the timed ones of
+ * their priority, in the order given, except in the daemon, which
+ * tries them first so that they get timed. What a child learns is
+ * lost when it exits.
+ */
+static int server_before(struct ldap_server *a, struct ldap_server *b,
+			 time_t now, int explore)
+{
+	int a_failed = a->failed && now - a->failed < LDAP_RETRY_FAILED;
+	int b_failed = b->failed && now - b->failed < LDAP_RETRY_FAILED;
+
+	if (a_failed != b_failed)
+		return b_failed;
+
+	if (a_failed)
+		return a->failed < b->failed;
+
+	if (a->prio != b->prio)
+		return a->prio < b->prio;
+
+	if (!a->rtt || !b->rtt)
+		return explore ? !a->rtt && b->rtt : a->rtt && !b->rtt;
+
+	return a->rtt < b->rtt;
+}
+
+/* The server to try next, of those not in tried */
+static struct ldap_server *server_next(struct ldap_conn *conn,
+				       unsigned int tried, time_t now)
+{
+	struct ldap_server *best = NULL;
+	int explore = conn->owner == getpid();
+	int i;
+
+	for (i = 0; i < conn->nservers; i++) {
+		struct ldap_server *server = &conn->servers[i];
+
+		if (tried & (1 << i))
+			continue;
+		if (!best || server_before(server, best, now, explore))
+			best = server;
+	}
+
+	return best;
+}
+
+/* A search on server took usecs */
+static void server_timed(struct ldap_server *server, long usecs)
+{
+	if (!server->rtt)
+		server->rtt = usecs ? usecs : 1;
+	else
+		server->rtt += (usecs - server->rtt) / LDAP_RTT_WEIGHT;
+	server->failed = 0;
+}
+
+static const char *server_name(struct ldap_server *server)
+{
+	return server->host ? server->host : "default server";
+}
+
+/* The open connection of ctxt, opened if need be */
+static LDAP *conn_get(struct lookup_context *ctxt, int *result_ldap)
+{
+	struct ldap_conn *conn = ctxt->conn;
+	time_t now = time(NULL);
+
+	if (conn->ldap) {
+		if (conn->pid != getpid()) {
+			debug(MODPREFIX "%s: not using connection of parent",
+			      __func__);
+			conn_close(conn);
+		} else if (now - conn->used >= LDAP_IDLE_TIMEOUT) {
+			debug(MODPREFIX "%s: reopening idle connection",
+			      __func__);
+			conn_close(conn);
+		} else if (now - conn->used >= LDAP_CHECK_IDLE &&
+			   !conn_alive(conn)) {
+			debug(MODPREFIX "%s: connection closed by server",
+			      __func__);
+			conn_close(conn);
+		}
+	}
+
+	if (!conn->ldap) {
+		struct ldap_server *server;
+		unsigned int tried = 0;
+
+		while ((server = server_next(conn, tried, now))) {
+			tried |= 1 << (server - conn->servers);
+
+			debug(MODPREFIX "%s: connecting to %s", __func__,
+			      server_name(server));
+			conn->ldap = do_connect(ctxt, server, result_ldap);
+			if (conn->ldap)
+				break;
+			server->failed = now;
+		}
+		if (!conn->ldap)
+			return NULL;
+		conn->cur = server;
+		conn->pid = getpid();
+	}
+
+	conn->used = now;
+	return conn->ldap;
+}
+
+static void conn_put(struct lookup_context *ctxt)
+{
+	struct ldap_conn *conn = ctxt->conn;
+	struct ldap_conn **prev;
+
+	if (!conn || --conn->refs)
+		return;
+
+	conn_close(conn);
+
+	for (prev = &conns; *prev; prev = &(*prev)->next) {
+		if (*prev == conn) {
+			*prev = conn->next;
+			break;
+		}
+	}
+	conn_free(conn);
+}
+
+/* Takes each entry of a paged search in turn */
+typedef void (*entry_fn)(LDAP *ldap, LDAPMessage *e, void *arg);
+
+/*
+ * Search below base, giving up after LDAP_SEARCH_TOUT. The server is
+ * given the same time limit, and told when we give up.
+ */
+static int search_timed(LDAP *ldap, const char *base, int scope,
+			const char *query, char **attrs, int sizelimit,
+			LDAPMessage **result)
+{
+	struct timeval tout;
+	int msgid, rv;
+
+	tout.tv_sec = LDAP_SEARCH_TOUT;
+	tout.tv_usec = 0;
+
+	rv = ldap_search_ext(ldap, base, scope, query, attrs, 0,
+			     NULL, NULL, &tout, sizelimit, &msgid);
+	if (rv != LDAP_SUCCESS)
+		return rv;
+
+	tout.tv_sec = LDAP_SEARCH_TOUT;
+	tout.tv_usec = 0;
+
+	rv = ldap_result(ldap, msgid, LDAP_MSG_ALL, &tout, result);
+	if (rv == 0) {
+		ldap_abandon_ext(ldap, msgid, NULL, NULL);
+		return LDAP_TIMEOUT;
+	}
+
+	if (rv == -1) {
+		rv = LDAP_SERVER_DOWN;
+		ldap_get_option(ldap, LDAP_OPT_RESULT_CODE, &rv);
+		return rv;
+	}
+
+	rv = LDAP_LOCAL_ERROR;
+	ldap_parse_result(ldap, *result, &rv, NULL, NULL, NULL, NULL, 0);
+
+	/* All that was asked for */
+	if (rv == LDAP_SIZELIMIT_EXCEEDED && sizelimit != LDAP_NO_LIMIT)
+		rv = LDAP_SUCCESS;
+
+	return rv;
+}
+
+/*
+ * Search below base a page of LDAP_PAGE_SIZE entries at a time (RFC
+ * 2696), handing each entry to fn as it comes and freeing it after,
+ * so no more than one is held however big the map. Each page has
+ * LDAP_SEARCH_TOUT to arrive, and first is when the first did. A
+ * server that doesn't do paging sends everything at once, which is
+ * still taken an entry at a time.
+ */
+static int search_paged(LDAP *ldap, const char *base, int scope,
+			const char *query, char **attrs,
+			entry_fn fn, void *arg, int *got, struct timeval *first)
+{
+	struct berval cookie;
+	LDAPControl *page, *sctrls[2];
+	LDAPControl **rctrls, *resp;
+	LDAPMessage *msg;
+	struct timeval tout, deadline, now;
+	ber_int_t count;
+	int msgid, rv, pages = 0;
+
+	cookie.bv_len = 0;
+	cookie.bv_val = NULL;
+
+	do {
+		rv = ldap_create_page_control(ldap, LDAP_PAGE_SIZE,
+					      pages ? &cookie : NULL, 0, &page);
+		if (cookie.bv_val) {
+			ber_memfree(cookie.bv_val);
+			cookie.bv_val = NULL;
+			cookie.bv_len = 0;
+		}
+		if (rv != LDAP_SUCCESS)
+			return rv;
+
+		sctrls[0] = page;
+		sctrls[1] = NULL;
+
+		tout.tv_sec = LDAP_SEARCH_TOUT;
+		tout.tv_usec = 0;
+
+		rv = ldap_search_ext(ldap, base, scope, query,
+				     attrs, 0, sctrls, NULL, &tout,
+				     LDAP_NO_LIMIT, &msgid);
+		ldap_control_free(page);
+		if (rv != LDAP_SUCCESS)
+			return rv;
+		pages++;
+
+		gettimeofday(&deadline, NULL);
+		deadline.tv_sec += LDAP_SEARCH_TOUT;
+
+		while (1) {
+			gettimeofday(&now, NULL);
+			timersub(&deadline, &now, &tout);
+			if (tout.tv_sec < 0)
+				timerclear(&tout);
+
+			rv = ldap_result(ldap, msgid, LDAP_MSG_ONE, &tout, &msg);
+			if (rv == 0) {
+				ldap_abandon_ext(ldap, msgid, NULL, NULL);
+				return LDAP_TIMEOUT;
+			}
+
+			if (rv == -1) {
+				rv = LDAP_SERVER_DOWN;
+				ldap_get_option(ldap, LDAP_OPT_RESULT_CODE, &rv);
+				return rv;
+			}
+
+			if (rv == LDAP_RES_SEARCH_RESULT)
+				break;
+
+			if (rv == LDAP_RES_SEARCH_ENTRY) {
+				fn(ldap, msg, arg);
+				(*got)++;
+			}
+			ldap_msgfree(msg);
+		}
+
+		if (pages == 1)
+			gettimeofday(first, NULL);
+
+		rctrls = NULL;
+		rv = LDAP_LOCAL_ERROR;
+		ldap_parse_result(ldap, msg, &rv, NULL, NULL, NULL, &rctrls, 1);
+		if (rv != LDAP_SUCCESS) {
+			if (rctrls)
+				ldap_controls_free(rctrls);
+			return rv;
+		}
+
+		resp = ldap_control_find(LDAP_CONTROL_PAGEDRESULTS, rctrls, NULL);
+		if (resp)
+			ldap_parse_pageresponse_control(ldap, resp, &count, &cookie);
+		if (rctrls)
+			ldap_controls_free(rctrls);
+	} while (cookie.bv_val && cookie.bv_len);
+
+	if (cookie.bv_val)
+		ber_memfree(cookie.bv_val);
+
+	debug(MODPREFIX "%s: %d entries in %d pages", __func__, *got, pages);
+
+	return LDAP_SUCCESS;
+}
+
+/*
+ * Run a search on the connection of ctxt, the result, of no more than
+ * sizelimit entries, left in result, or each entry handed to fn if it
+ * is given. If it takes too
+ * long the next server is asked, and one that went away is connected
+ * to again and asked once more. Entries already handed on can't be
+ * taken back, so once there are some a failure is final.
+ */
+static LDAP *do_search(struct lookup_context *ctxt,
+		       const char *base, int scope, const char *query,
+		       char **attrs, int sizelimit, LDAPMessage **result,
+		       entry_fn fn, void *arg, int *result_ldap)
+{
+	struct ldap_conn *conn = ctxt->conn;
+	struct timeval start, end;
+	int left = conn->nservers;
+	int retry = 1;
+	LDAP *ldap;
+	int got = 0;
+	int rv;
+
+	while (1) {
+		ldap = conn_get(ctxt, result_ldap);
+		if (!ldap)
+			return NULL;
+
+		gettimeofday(&start, NULL);
+
+		/* Timed to the first page, the rest depends on the map */
+		if (fn)
+			rv = search_paged(ldap, base, scope, query, attrs,
+					  fn, arg, &got, &end);
+		else {
+			*result = NULL;
+			rv = search_timed(ldap, base, scope, query, attrs,
+					  sizelimit, result);
+			gettimeofday(&end, NULL);
+		}
+
+		if (rv == LDAP_SUCCESS) {
+			server_timed(conn->cur,
+				     (end.tv_sec - start.tv_sec) * 1000000 +
+				     end.tv_usec - start.tv_usec);
+			return ldap;
+		}
+
+		if (!fn && *result) {
+			ldap_msgfree(*result);
+			*result = NULL;
+		}
+
+		if (got) {
+			error(MODPREFIX "search of %s failed after %d entries",
+			      server_name(conn->cur), got);
+			if (rv == LDAP_TIMEOUT || rv == LDAP_SERVER_DOWN ||
+			    rv == LDAP_CONNECT_ERROR)
+				conn_close(conn);
+			break;
+		}
+
+		if (rv == LDAP_TIMEOUT) {
+			warn(MODPREFIX "search of %s timed out",
+			     server_name(conn->cur));
+			server_timed(conn->cur, LDAP_SEARCH_TOUT * 1000000L);
+			conn->cur->failed = time(NULL);
+			if (!--left)
+				break;
+		} else if (rv == LDAP_SERVER_DOWN || rv == LDAP_CONNECT_ERROR) {
+			warn(MODPREFIX "lost connection to %s, reconnecting",
+			     server_name(conn->cur));
+			if (!retry--)
+				break;
+		} else
+			break;
+
+		conn_close(conn);
+	}
+
+	if (result_ldap)
+		*result_ldap = rv;
+	return NULL;
+}
+
+/* Is the base itself of the map object class, -1 if we can't tell */
+static int base_is_map(struct lookup_context *ctxt, const char *class)
+{
+	char *attrs[] = { "1.1", NULL };	/* no attributes, RFC 4511 */
+	LDAPMessage *result;
+	char *query;
+	LDAP *ldap;
+	int count, rv;
+
+	query = alloca(strlen("(objectclass=)") + strlen(class) + 1);
+	sprintf(query, "(objectclass=%s)", class);
+
+	ldap = do_search(ctxt, ctxt->base, LDAP_SCOPE_BASE, query, attrs, 1,
+			 &result, NULL, NULL, &rv);
+	if (!ldap)
+		return -1;
+
+	count = ldap_count_entries(ldap, result);
+	ldap_msgfree(result);
+
+	return count == 1;
+}
+
+/*
+ * Entries are searched for one level below the base when the base is
+ * the map object, so the server doesn't go through a whole subtree for
+ * each of them. Otherwise entries may be anywhere below the base, and
+ * the whole of it is searched as it always was.
+ */
+static void find_scope(struct lookup_context *ctxt,
+		       struct autofs_schema *schema)
+{
+	if (base_is_map(ctxt, schema->map_object_class) == 1)
+		ctxt->scope = LDAP_SCOPE_ONELEVEL;
+	else
+		ctxt->scope = LDAP_SCOPE_SUBTREE;
+
+	debug(MODPREFIX "%s: entries are %s \"%s\"", __func__,
+	      ctxt->scope == LDAP_SCOPE_ONELEVEL ? "under" : "anywhere below",
+	      ctxt->base);
+}
+
+/*
+ * Which schema the map uses, from a single entry of any of them. The
+ * daemon finds it as soon as it can, so that the children forked for
+ * lookups start out knowing it. NULL with *result_ldap LDAP_SUCCESS if
+ * the map has no entries.
+ */
+static struct autofs_schema *find_schema(struct lookup_context *ctxt,
+					 int *result_ldap)
+{
+	struct autofs_schema *schema = NULL;
+	char *attrs[NR_SCHEMAS + 2];
+	LDAPMessage *result, *e;
+	char **classes, **keys;
+	char *query, *q;
+	int i, j, l, n;
+	LDAP *ldap;
+
+	if (ctxt->schema && !ap.use_old_ldap_lookup)
+		return ctxt->schema;
+
+	/* (|(&(objectclass=<class>)(<key>=*))...) */
+	l = strlen("(|)") + 1;
+	for (i = 0; i < NR_SCHEMAS; i++)
+		l += strlen("(&(objectclass=)(=*))") +
+		     strlen(supported_schemas[i].entry_object_class) +
+		     strlen(supported_schemas[i].entry_key_attr);
+
+	query = alloca(l);
+	q = query + sprintf(query, "(|");
+	for (i = 0; i < NR_SCHEMAS; i++)
+		q += sprintf(q, "(&(objectclass=%s)(%s=*))",
+			     supported_schemas[i].entry_object_class,
+			     supported_schemas[i].entry_key_attr);
+	strcpy(q, ")");
+
+	n = 0;
+	attrs[n++] = "objectclass";
+	for (i = 0; i < NR_SCHEMAS; i++) {
+		for (j = 0; j < n; j++) {
+			if (!strcasecmp(attrs[j], supported_schemas[i].entry_key_attr))
+				break;
+		}
+		if (j == n)
+			attrs[n++] = supported_schemas[i].entry_key_attr;
+	}
+	attrs[n] = NULL;
+
+	debug(MODPREFIX "%s: searching for \"%s\" under \"%s\"", __func__, query, ctxt->base);
+
+	*result_ldap = LDAP_SUCCESS;
+	ldap = do_search(ctxt, ctxt->base, LDAP_SCOPE_SUBTREE, query, attrs,
+			 1, &result, NULL, NULL, result_ldap);
+	if (!ldap) {
+		crit(MODPREFIX "%s: query failed for %s: %s", __func__, query,
+		     ldap_err2string(*result_ldap));
+		return NULL;
+	}
+
+	e = ldap_first_entry(ldap, result);
+	if (!e) {
+		debug(MODPREFIX "%s: no entries under %s", __func__, ctxt->base);
+		ldap_msgfree(result);
+		return NULL;
+	}
+
+	/* The first schema the entry fits, there may be more */
+	classes = ldap_get_values(ldap, e, "objectclass");
+	for (i = 0; classes && i < NR_SCHEMAS && !schema; i++) {
+		for (j = 0; classes[j]; j++) {
+			if (strcasecmp(classes[j],
+				       supported_schemas[i].entry_object_class))
+				continue;
+
+			keys = ldap_get_values(ldap, e,
+					       supported_schemas[i].entry_key_attr);
+			if (keys) {
+				schema = &supported_schemas[i];
+				ldap_value_free(keys);
+			}
+			break;
+		}
+	}
+	if (classes)
+		ldap_value_free(classes);
+	ldap_msgfree(result);
+
+	if (!schema) {
+		error(MODPREFIX "%s: entry under %s fits no schema",
+		      __func__, ctxt->base);
+		return NULL;
+	}
+
+	debug(MODPREFIX "%s: using schema %s,%s,%s", __func__,
+	      schema->entry_object_class, schema->entry_key_attr,
+	      schema->entry_value_attr);
+
+	if (schema != ctxt->schema)
+		find_scope(ctxt, schema);
+
+	ctxt->schema = schema;
+	return schema;
+}
+
+/* Add a copy of v to the NULL terminated vals */
+static int values_add(char ***vals, const char *v)
+{
+	char **tmp;
+	int n = 0;
+
+	while (*vals && (*vals)[n])
+		n++;
+
+	tmp = realloc(*vals, (n + 2) * sizeof(char *));
+	if (!tmp)
+		return 0;
+	*vals = tmp;
+
+	tmp[n + 1] = NULL;
+	return (tmp[n] = strdup(v)) != NULL;
+}
+
+static void values_free(char **vals)
+{
+	int i;
+
+	if (!vals)
+		return;
+	for (i = 0; vals[i]; i++)
+		free(vals[i]);
+	free(vals);
+}
+
+/* Copies of the type values of e, none if there is no e */
+static int entry_values(LDAP *ldap, LDAPMessage *e, const char *type,
+			char ***vals)
+{
+	char **values;
+	int i, ok = 1;
+
+	if (!e)
+		return 1;
+
+	values = ldap_get_values(ldap, e, type);
+	if (!values) {
+		debug(MODPREFIX "%s: no %s defined", __func__, type);
+		return 1;
+	}
+
+	for (i = 0; ok && values[i]; i++)
+		ok = values_add(vals, values[i]);
+	ldap_value_free(values);
+
+	return ok;
+}
+
+/*
+ * Search for qKey, and in the same search for the wildcard entry if
+ * wild is set. Copies of the values found are left in kv and wv, NULL
+ * if there is no entry or it has no value. Returns 0 if the search
+ * failed.
+ */
+static int search_key(struct lookup_context *ctxt,
+		      struct autofs_schema *schema, const char *qKey,
+		      int wild, char ***kv, char ***wv)
+{
+	int rv, i, l, ql, ok;
+	char *query;
+	LDAP *ldap;
+	LDAPMessage *result, *e, *key_e, *wild_e;
+	char **keys;
+	char *attrs[] = { schema->entry_key_attr,
+			  schema->entry_value_attr,
+			  NULL };
+	const char *class = schema->entry_object_class,
+		   *key = schema->entry_key_attr,
+		   *type = schema->entry_value_attr;
+
+	*kv = *wv = NULL;
+
+	/* Build a query string. */
+	l = strlen("(&(objectclass=") + strlen(class) + strlen(")");
+	l += strlen("(|(") + strlen(key) + strlen("=") + strlen(qKey) +
+	     strlen(")(") + strlen(key) + strlen("=/))") + strlen(")") + 1;
+
+	query = alloca(l);
+	if (query == NULL) {
+		crit(MODPREFIX "%s: alloca returned NULL", __func__ );
+		return 0;
+	}
+
+	/* Look around. */
+	memset(query, '\0', l);
+	if (wild)
+		ql = sprintf(query, "(&(objectclass=%s)(|(%s=%s)(%s=/)))",
+			     class, key, qKey, key);
+	else
+		ql = sprintf(query, "(&(objectclass=%s)(%s=%s))",
+			     class, key, qKey);
+	if (ql >= l) {
+		debug(MODPREFIX "%s: error forming query string", __func__);
+		return 0;
+	}
+	query[l - 1] = '\0';
+
+	debug(MODPREFIX "%s: searching for \"%s\" under \"%s\"", __func__, query, ctxt->base);
+
+	ldap = do_search(ctxt, ctxt->base, ctxt->scope, query, attrs,
+			 LDAP_NO_LIMIT, &result, NULL, NULL, &rv);
+	if (!ldap) {
+		crit(MODPREFIX "%s: query failed for %s", __func__, query);
+		return 0;
+	}
+
+	/* The first entry for the key and the first wildcard */
+	key_e = wild_e = NULL;
+	for (e = ldap_first_entry(ldap, result); e; e = ldap_next_entry(ldap, e)) {
+		keys = ldap_get_values(ldap, e, key);
+		for (i = 0; keys && keys[i]; i++) {
+			if (!strcmp(keys[i], "/")) {
+				if (!wild_e)
+					wild_e = e;
+			} else if (!key_e)
+				key_e = e;
+		}
+		if (keys)
+			ldap_value_free(keys);
+	}
+
+	ok = entry_values(ldap, key_e, type, kv) &&
+	     entry_values(ldap, wild_e, type, wv);
+
+	/* Clean up. */
+	ldap_msgfree(result);
+
+	if (!ok) {
+		crit(MODPREFIX "%s: malloc: %m", __func__);
+		values_free(*kv);
+		values_free(*wv);
+		*kv = *wv = NULL;
+	}
+
+	return ok;
+}
+
+/*
+ * The helper: a child of the daemon that keeps a connection open for
+ * the key lookups of the children forked for mounts, so that each of
+ * those doesn't have to connect and bind to search once. A child sends
+ * it the key with one end of a socketpair for the answer: whether the
+ * search worked, then each value found tagged as the key's or the
+ * wildcard's. The child brings its own cache up to date from that.
+ * Lookups are answered one at a time.
+ */
+static int helper_send(int fd, const char *buf, int len)
+{
+	int n;
+
+	while (len > 0) {
+		n = send(fd, buf, len, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return 0;
+		buf += n;
+		len -= n;
+	}
+	return 1;
+}
+
+static int helper_send_values(int fd, char tag, char **vals)
+{
+	int i;
+
+	for (i = 0; vals && vals[i]; i++) {
+		if (!helper_send(fd, &tag, 1) ||
+		    !helper_send(fd, vals[i], strlen(vals[i]) + 1))
+			return 0;
+	}
+	return 1;
+}
+
+static void helper_answer(struct lookup_context *ctxt, int fd,
+			  int wild, const char *qKey)
+{
+	struct autofs_schema *schema;
+	struct timeval tout = { LDAP_NET_TOUT, 0 };
+	char **kv = NULL, **wv = NULL;
+	int ok, rv;
+
+	schema = find_schema(ctxt, &rv);
+	if (schema)
+		ok = search_key(ctxt, schema, qKey, wild, &kv, &wv);
+	else
+		ok = rv == LDAP_SUCCESS;
+
+	/* Don't hang on a lookup that has stopped reading */
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tout, sizeof(tout));
+
+	if (helper_send(fd, ok ? "1" : "0", 1) &&
+	    helper_send_values(fd, 'k', kv))
+		helper_send_values(fd, 'w', wv);
+
+	values_free(kv);
+	values_free(wv);
+}
+
+static void helper_serve(struct lookup_context *ctxt, int sock)
+{
+	char req[KEY_MAX_LEN + 2];
+	union {
+		struct cmsghdr cm;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctl;
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct iovec iov;
+	struct ldap_conn *conn = ctxt->conn;
+	struct pollfd pfd;
+	int n, fd, idle;
+
+	while (1) {
+		/* Wait for a lookup, closing the connection if none comes */
+		idle = -1;
+		if (conn->ldap && conn->pid == getpid()) {
+			idle = conn->used + LDAP_IDLE_TIMEOUT - time(NULL);
+			idle = idle > 0 ? idle * 1000 : 0;
+		}
+
+		pfd.fd = sock;
+		pfd.events = POLLIN;
+		n = poll(&pfd, 1, idle);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n == 0) {
+			debug(MODPREFIX "%s: closing idle connection", __func__);
+			conn_close(conn);
+			continue;
+		}
+
+		memset(&msg, 0, sizeof(msg));
+		iov.iov_base = req;
+		iov.iov_len = sizeof(req) - 1;
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = ctl.buf;
+		msg.msg_controllen = sizeof(ctl.buf);
+
+		n = recvmsg(sock, &msg, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		/* The daemon and its children are gone */
+		if (n <= 0)
+			break;
+
+		fd = -1;
+		cm = CMSG_FIRSTHDR(&msg);
+		if (cm && cm->cmsg_level == SOL_SOCKET &&
+		    cm->cmsg_type == SCM_RIGHTS)
+			memcpy(&fd, CMSG_DATA(cm), sizeof(int));
+		if (fd < 0)
+			continue;
+
+		if (n >= 2) {
+			req[n] = '\0';
+			helper_answer(ctxt, fd, req[0] == 'w', req + 1);
+		}
+		close(fd);
+	}
+}
+
+/* Start the helper for ctxt, lookups search for themselves without */
+static void helper_start(struct lookup_context *ctxt)
+{
+	int sv[2];
+	pid_t f;
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+		error(MODPREFIX "%s: socketpair: %m", __func__);
+		return;
+	}
+
+	f = fork();
+	if (f < 0) {
+		error(MODPREFIX "%s: fork: %m", __func__);
+		close(sv[0]);
+		close(sv[1]);
+		return;
+	} else if (f == 0) {
+		ignore_signals();
+		signal(SIGTERM, SIG_DFL);
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+		/* Out of the way of a direct map supervisor's waitpid(0) */
+		setpgid(0, 0);
+
+		close(sv[0]);
+		helper_serve(ctxt, sv[1]);
+		exit(0);
+	}
+
+	debug(MODPREFIX "%s: helper %d for %s", __func__, f, ctxt->base);
+
+	close(sv[1]);
+	fcntl(sv[0], F_SETFD, FD_CLOEXEC);
+	ctxt->helper_fd = sv[0];
+	ctxt->helper_pid = f;
+}
+
+/*
+ * How long to wait on the helper: long enough for it to fail over
+ * through every server, connecting to each and searching.
+ */
+static int helper_wait(struct lookup_context *ctxt)
+{
+	int n = ctxt->conn->nservers;
+
+	return (LDAP_NET_TOUT + LDAP_SEARCH_TOUT) * (n > 1 ? n : 1);
+}
+
+/*
+ * Have the helper search for qKey. Returns -1 if it couldn't be asked
+ * or didn't answer, else whether the search worked, with the values
+ * as search_key() leaves them.
+ */
+static int ask_helper(struct lookup_context *ctxt, const char *qKey,
+		      int wild, char ***kv, char ***wv)
+{
+	char req[KEY_MAX_LEN + 2];
+	union {
+		struct cmsghdr cm;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctl;
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct iovec iov;
+	char *buf = NULL, *p, *end;
+	int len = 0, size = 0, done = 0;
+	time_t deadline;
+	int sv[2], n, ok;
+
+	*kv = *wv = NULL;
+
+	if (ctxt->helper_fd < 0 || strlen(qKey) > KEY_MAX_LEN)
+		return -1;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) < 0)
+		return -1;
+
+	n = sprintf(req, "%c%s", wild ? 'w' : 'k', qKey);
+	iov.iov_base = req;
+	iov.iov_len = n;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl.buf;
+	msg.msg_controllen = sizeof(ctl.buf);
+	cm = CMSG_FIRSTHDR(&msg);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cm), &sv[1], sizeof(int));
+
+	n = sendmsg(ctxt->helper_fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+	close(sv[1]);
+	if (n < 0) {
+		debug(MODPREFIX "%s: can't ask the helper: %m", __func__);
+		close(sv[0]);
+		return -1;
+	}
+
+	/* The answer ends when the helper closes its end */
+	deadline = time(NULL) + helper_wait(ctxt);
+	while (!done) {
+		struct pollfd pfd;
+		time_t left = deadline - time(NULL);
+
+		if (left <= 0)
+			break;
+
+		pfd.fd = sv[0];
+		pfd.events = POLLIN;
+		n = poll(&pfd, 1, left * 1000);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+
+		if (len == size) {
+			char *tmp = realloc(buf, size + MAPENT_MAX_LEN + 1);
+
+			if (!tmp)
+				break;
+			buf = tmp;
+			size += MAPENT_MAX_LEN + 1;
+		}
+
+		n = read(sv[0], buf + len, size - len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			break;
+		if (n == 0)
+			done = 1;
+		len += n;
+	}
+	close(sv[0]);
+
+	if (!done || !len) {
+		warn(MODPREFIX "%s: no answer from the helper for %s",
+		     __func__, qKey);
+		free(buf);
+		return -1;
 	}
 
-	/* Connect to the server as an anonymous user. */
-	if (version == 2)
-		rv = ldap_simple_bind_s(ldap, ctxt->base, NULL);
-	else
-		rv = ldap_simple_bind_s(ldap, NULL, NULL);
+	ok = buf[0] == '1';
+	p = buf + 1;
+	end = buf + len;
+	while (p < end) {
+		char tag = *p++;
+		char *v = p;
+
+		p = memchr(v, '\0', end - v);
+		if (!p || !values_add(tag == 'w' ? wv : kv, v)) {
+			error(MODPREFIX "%s: bad answer from the helper", __func__);
+			ok = -1;
+			break;
+		}
+		p++;
+	}
+	free(buf);
 
-	if (rv != LDAP_SUCCESS) {
-		crit(MODPREFIX "couldn't bind to %s",
-		     ctxt->server ? ctxt->server : "default server");
-		*result_ldap = rv;
-		return NULL;
+	if (ok < 0) {
+		values_free(*kv);
+		values_free(*wv);
+		*kv = *wv = NULL;
 	}
 
-	return ldap;
+	return ok;
 }
 
 /*
@@ -150,7 +1371,6 @@ int lookup_init(const char *mapfmt, int argc, const char *const *argv, void **co
 {
 	struct lookup_context *ctxt = NULL;
 	int l, rv;
-	LDAP *ldap;
 	char *ptr = NULL;
 
 	/* If we can't build a context, bail. */
@@ -175,6 +1395,7 @@ int lookup_init(const char *mapfmt, int argc, const char *const *argv, void **co
 	ctxt->server = NULL;
 	ctxt->port = LDAP_PORT;
 	ctxt->base = NULL;
+	ctxt->helper_fd = -1;
 
 	ptr = (char *) argv[0];
 
@@ -215,39 +1436,93 @@ int lookup_init(const char *mapfmt, int argc, const char *const *argv, void **co
 	memset(ctxt->base, 0, l + 1);
 	memcpy(ctxt->base, ptr, l);
 
+	ctxt->scope = LDAP_SCOPE_SUBTREE;
+
 	debug(MODPREFIX "%s: server = \"%s\", port = %d, base dn = \"%s\"", __func__,
 		  ctxt->server ? ctxt->server : "(default)",
 		  ctxt->port, ctxt->base);
 
-	/* Initialize the LDAP context. */
-	ldap = do_connect(ctxt, &rv);
-	if (!ldap)
+	ctxt->conn = conn_find(ctxt->server, ctxt->port);
+	if (!ctxt->conn && !(ctxt->conn = conn_new(ctxt)))
+		return 1;
+	ctxt->conn->refs++;
+
+	/* Connect now, to know the server is there */
+	if (!conn_get(ctxt, &rv))
 		return 1;
 
-	/* Okay, we're done here. */
-	ldap_unbind(ldap);
+	/* An empty map may get entries later, it's looked for again then */
+	find_schema(ctxt, &rv);
+
+	/* Not for the helper to inherit, it opens its own */
+	conn_close(ctxt->conn);
+
+	helper_start(ctxt);
 
 	/* Open the parser, if we can. */
 	return !(ctxt->parse = open_parse(mapfmt, MODPREFIX, argc - 1, argv + 1));
 }
 
-static int read_one_map(LDAP *ldap, const char *root,
+/* Where the entries of a map being read go */
+struct map_read {
+	const char *root;
+	struct autofs_schema *schema;
+	time_t age;
+	int found_entry;
+};
+
+static void read_entry(LDAP *ldap, LDAPMessage *e, void *arg)
+{
+	struct map_read *mr = (struct map_read *) arg;
+	const char *key = mr->schema->entry_key_attr,
+		   *type = mr->schema->entry_value_attr;
+	char **keyValue = NULL;
+	char **values = NULL;
+	int i, j, count, keycount;
+
+	keyValue = ldap_get_values(ldap, e, key);
+	if (!keyValue || !*keyValue) {
+		if (keyValue)
+			ldap_value_free(keyValue);
+		return;
+	}
+
+	mr->found_entry = 1;
+
+	values = ldap_get_values(ldap, e, type);
+	if (!values) {
+		info(MODPREFIX "%s: no %s defined for %s", __func__, type, *keyValue);
+		ldap_value_free(keyValue);
+		return;
+	}
+
+	count = ldap_count_values(values);
+	keycount = ldap_count_values(keyValue);
+	for (i = 0; i < count; i++) {
+		for (j = 0; j < keycount; j++) {
+			if (*(keyValue[j]) == '/' &&
+			    strlen(keyValue[j]) == 1)
+				*(keyValue[j]) = '*';
+			cache_add(mr->root, keyValue[j], values[i], mr->age);
+		}
+	}
+	ldap_value_free(values);
+
+	ldap_value_free(keyValue);
+}
+
+static int read_one_map(const char *root,
 			struct autofs_schema *schema,			
 			struct lookup_context *ctxt,
 			time_t age, int *result_ldap)
 {
-	int rv, i, j, l, count, keycount;
+	int l;
 	char *query;
-	LDAPMessage *result, *e;
-	char **keyValue = NULL;
-	char **values = NULL;
+	struct map_read mr;
 	char *attrs[] = { schema->entry_key_attr,
 			  schema->entry_value_attr,
 			  NULL };
-	const char *class = schema->entry_object_class,
-		   *key = schema->entry_key_attr,
-		   *type = schema->entry_value_attr;
-	int found_entry = 0;
+	const char *class = schema->entry_object_class;
 
 	if (ctxt == NULL) {
 		crit(MODPREFIX "%s: context was NULL", __func__);
@@ -273,110 +1548,42 @@ static int read_one_map(LDAP *ldap, const char *root,
 	/* Look around. */
 	debug(MODPREFIX "%s: searching for \"%s\" under \"%s\"", __func__, query, ctxt->base);
 
-	rv = ldap_search_s(ldap, ctxt->base, LDAP_SCOPE_SUBTREE,
-			   query, attrs, 0, &result);
+	mr.root = root;
+	mr.schema = schema;
+	mr.age = age;
+	mr.found_entry = 0;
 
-	if ((rv != LDAP_SUCCESS) || !result) {
-	        crit(MODPREFIX "%s: query failed for %s: %s", __func__, query, ldap_err2string(rv));
-		*result_ldap = rv;
+	if (!do_search(ctxt, ctxt->base, ctxt->scope, query, attrs,
+		       LDAP_NO_LIMIT, NULL, read_entry, &mr, result_ldap)) {
+	        crit(MODPREFIX "%s: query failed for %s: %s", __func__, query, ldap_err2string(*result_ldap));
 		return 0;
 	}
 
-	e = ldap_first_entry(ldap, result);
-	if (!e) {
+	if (!mr.found_entry) {
 		debug(MODPREFIX "%s: query succeeded, no matches for %s", __func__, query);
-		ldap_msgfree(result);
 		return 0;
-	} else
-		debug(MODPREFIX "%s: examining entries", __func__ );
-
-	while (e) {
-		keyValue = ldap_get_values(ldap, e, key);
-
-		if (!keyValue || !*keyValue) {
-			e = ldap_next_entry(ldap, e);
-			continue;
-		}
-
-		found_entry = 1;
-
-		values = ldap_get_values(ldap, e, type);
-		if (!values) {
-			info(MODPREFIX "%s: no %s defined for %s", __func__, type, query);
-			ldap_value_free(keyValue);
-			e = ldap_next_entry(ldap, e);
-			continue;
-		}
-
-		count = ldap_count_values(values);
-		keycount = ldap_count_values(keyValue);
-		for (i = 0; i < count; i++) {
-			for (j = 0; j < keycount; j++) {
-				if (*(keyValue[j]) == '/' &&
-				    strlen(keyValue[j]) == 1)
-					*(keyValue[j]) = '*';
-				cache_add(root, keyValue[j], values[i], age);
-			}
-		}
-		ldap_value_free(values);
-
-		ldap_value_free(keyValue);
-		e = ldap_next_entry(ldap, e);
 	}
 
 	debug(MODPREFIX "%s: done updating map", __func__ );
 
-	/* Clean up. */
-	ldap_msgfree(result);
-
-	if (found_entry) 
-		return 1;
-	else
-		return 0;
+	return 1;
 }
 
 static int read_map(const char *root, struct lookup_context *ctxt,
 		    time_t age, int *result_ldap)
 {
-	LDAP *ldap;
+	struct autofs_schema *schema;
 	int rv = LDAP_SUCCESS;
-	int ret, i;
 
-	/* Initialize the LDAP context. */
-	ldap = do_connect(ctxt, &rv);
-	if (!ldap) {
-		if (rv != LDAP_SUCCESS)
+	schema = find_schema(ctxt, &rv);
+	if (!schema || !read_one_map(root, schema, ctxt, age, &rv)) {
+		if (result_ldap)
 			*result_ldap = rv;
 		return 0;
 	}
 
-	/* all else fails read entire map */
-	if (ctxt->schema) {
-		ret = read_one_map(ldap, root, ctxt->schema, ctxt, age, &rv);
-		if (ret == 1 && rv == LDAP_SUCCESS)
-			goto ret_ok;
-	} else {
-		for (i = 0; i < NR_SCHEMAS; i++) {
-			ret = read_one_map(ldap, root,
-					   &supported_schemas[i],
-					   ctxt, age, &rv);
-			if (ret == 1 && rv == LDAP_SUCCESS) {
-				set_schema(ctxt, &supported_schemas[i]);
-				goto ret_ok;
-			}
-		}
-	}
- 
-	ldap_unbind(ldap);
-	if (result_ldap)
-		*result_ldap = rv;
-
-	return 0;
-
-ret_ok:
 	/* Clean stale entries from the cache */
 	cache_clean(root, age);
-	ldap_unbind(ldap);
 	return 1;
 }
 
@@ -390,7 +1597,22 @@ int lookup_ghost(const char *root, int ghost, time_t now, void *context)
 
 	chdir("/");
 
-	if (!read_map(root, ctxt, age, &rv))
+	/* Lookups without the helper would each open a connection */
+	if (ctxt->helper_pid > 0 && kill(ctxt->helper_pid, 0) < 0) {
+		warn(MODPREFIX "helper %d has gone, restarting it",
+		     ctxt->helper_pid);
+		close(ctxt->helper_fd);
+		ctxt->helper_fd = -1;
+		ctxt->helper_pid = 0;
+		helper_start(ctxt);
+	}
+
+	status = read_map(root, ctxt, age, &rv);
+
+	/* The daemon has no more use for it until the next read */
+	conn_close(ctxt->conn);
+
+	if (!status)
 		switch (rv) {
 		case LDAP_SIZELIMIT_EXCEEDED:
 		case LDAP_UNWILLING_TO_PERFORM:
@@ -429,80 +1651,16 @@ int lookup_ghost(const char *root, int ghost, time_t now, void *context)
 	return status;
 }
 
-static int lookup_one_schema(LDAP *ldap, const char *root, const char *qKey,
-			     struct autofs_schema *schema,
-			     struct lookup_context *ctxt)
+/* Make the cache entries for cache_key the values */
+static int update_key(const char *root, const char *cache_key,
+		      char **values, time_t age)
 {
-	int rv, i, l, ql;
-	time_t age = time(NULL);
-	char *query;
-	LDAPMessage *result, *e;
-	char **values = NULL;
-	char *attrs[] = { schema->entry_key_attr,
-			  schema->entry_value_attr,
-			  NULL };
-	const char *class = schema->entry_object_class,
-		   *key = schema->entry_key_attr,
-		   *type = schema->entry_value_attr;
 	struct mapent_cache *me = NULL;
-	int ret = CHE_OK;
-
-	if (ctxt == NULL) {
-		crit(MODPREFIX "%s: context was NULL", __func__ );
-		return 0;
-	}
-
-	/* Build a query string. */
-	l = strlen("(&(objectclass=") + strlen(class) + strlen(")");
-	l += strlen("(") + strlen(key) + strlen("=") 
-				+ strlen(qKey) + strlen("))") + 1;
-
-	query = alloca(l);
-	if (query == NULL) {
-		crit(MODPREFIX "%s: alloca returned NULL", __func__ );
-		return 0;
-	}
-
-	/* Look around. */
-	memset(query, '\0', l);
-	ql = sprintf(query, "(&(objectclass=%s)(%s=%s))", class, key, qKey);
-	if (ql >= l) {
-		debug(MODPREFIX "%s: error forming query string", __func__);
-		return 0;
-	}
-	query[l - 1] = '\0';
-
-	debug(MODPREFIX "%s: searching for \"%s\" under \"%s\"", __func__, query, ctxt->base);
-
-	rv = ldap_search_s(ldap, ctxt->base, LDAP_SCOPE_SUBTREE,
-			   query, attrs, 0, &result);
-
-	if ((rv != LDAP_SUCCESS) || !result) {
-		crit(MODPREFIX "%s: query failed for %s", __func__, query);
-		return 0;
-	}
-
-	debug(MODPREFIX "%s: getting first entry for %s=\"%s\"", __func__, key, qKey);
-
-	e = ldap_first_entry(ldap, result);
-	if (!e) {
-		debug(MODPREFIX "%s: got answer, but no first entry for %s", __func__, query);
-		ldap_msgfree(result);
-		return CHE_MISSING;
-	}
-
-	debug(MODPREFIX "%s: examining first entry", __func__);
-
-	values = ldap_get_values(ldap, e, type);
-	if (!values) {
-		debug(MODPREFIX "%s: no %s defined for %s", __func__, type, query);
-		ldap_msgfree(result);
-		return CHE_MISSING;
-	}
+	int i, ret = CHE_OK;
 
 	/* Compare cache entry against LDAP */
 	for (i = 0; values[i]; i++) {
-		me = cache_lookup(qKey);
+		me = cache_lookup(cache_key);
 		while (me && (strcmp(me->mapent, values[i]) != 0))
 			me = cache_lookup_next(me);
 		if (!me)
@@ -510,42 +1668,12 @@ static int lookup_one_schema(LDAP *ldap, const char *root, const char *qKey,
 	}
 
 	if (!me) {
-		cache_delete(root, qKey, 0);
-
-		for (i = 0; values[i]; i++) {	
-			rv = cache_add(root, qKey, values[i], age);
-			if (!rv)
-				return 0;
-		}
+		cache_delete(root, cache_key, 0);
 
 		ret = CHE_UPDATED;
-	}
-
-	/* Clean up. */
-	ldap_value_free(values);
-	ldap_msgfree(result);
-
-	return ret;
-}
-
-static int lookup_one(LDAP *ldap, const char *root, const char *qKey,
-		      struct lookup_context *ctxt)
-{
-	int ret, i;
-
-	if (ctxt->schema) {
-		ret = lookup_one_schema(ldap, root, qKey, ctxt->schema, ctxt);
-		debug("lookup_one with schema %s,%s,%s returns %d\n",
-		      ctxt->schema->entry_key_attr,
-		      ctxt->schema->entry_object_class,
-		      ctxt->schema->entry_value_attr, ret);
-	} else {
-		for (i = 0; i < NR_SCHEMAS; i++) {
-			ret = lookup_one_schema(ldap, root, qKey,
-					 &supported_schemas[i], ctxt);
-			debug("lookup_one with schema %d returns %d\n",i, ret);
-			if (ret != CHE_FAIL) {
-				set_schema(ctxt, &supported_schemas[i]);
+		for (i = 0; values[i]; i++) {
+			if (!cache_add(root, cache_key, values[i], age)) {
+				ret = CHE_FAIL;
 				break;
 			}
 		}
@@ -554,127 +1682,51 @@ static int lookup_one(LDAP *ldap, const char *root, const char *qKey,
 	return ret;
 }
 
-static int lookup_wild_schema(LDAP *ldap, const char *root,
-			      struct autofs_schema *schema,
-			      struct lookup_context *ctxt)
+/*
+ * Bring the cache entry for qKey up to date. If wild_ret is given the
+ * wildcard entry is asked for in the same search, and brought up to
+ * date too when there is no qKey, the outcome left in wild_ret.
+ */
+static int lookup_one(const char *root, const char *qKey, int *wild_ret,
+		      struct lookup_context *ctxt)
 {
-	int rv, i, l, ql;
+	struct autofs_schema *schema;
+	char **kv, **wv;
 	time_t age = time(NULL);
-	char *query;
-	LDAPMessage *result, *e;
-	char **values = NULL;
-	char *attrs[] = { schema->entry_key_attr,
-			  schema->entry_value_attr,
-			  NULL };
-	const char *class = schema->entry_object_class,
-		   *key = schema->entry_key_attr,
-		   *type = schema->entry_value_attr;
-	struct mapent_cache *me = NULL;
-	int ret = CHE_OK;
-	char qKey[KEY_MAX_LEN + 1];
-	int qKey_len;
-
-	if (ctxt == NULL) {
-		crit(MODPREFIX "%s: context was NULL", __func__);
-		return 0;
-	}
-
-	strcpy(qKey, "/");
-	qKey_len = 1;
-
-	/* Build a query string. */
-	l = strlen("(&(objectclass=") + strlen(class) + strlen(")");
-	l += strlen("(") + strlen(key) + strlen("=") + qKey_len + strlen("))") + 1;
+	int ok, ret, rv;
 
-	query = alloca(l);
-	if (query == NULL) {
-		crit(MODPREFIX "%s: malloc failed",__func__);
-		return 0;
-	}
-
-	/* Look around. */
-	memset(query, '\0', l);
-	ql = sprintf(query, "(&(objectclass=%s)(%s=%s))", class, key, qKey);
-	if (ql >= l) {
-		debug(MODPREFIX "%s: error forming query string", __func__);
-		return 0;
-	}
-	query[l - 1] = '\0';
-
-	debug(MODPREFIX "%s: searching for \"%s\" under \"%s\"", __func__, query, ctxt->base);
-
-	rv = ldap_search_s(ldap, ctxt->base, LDAP_SCOPE_SUBTREE,
-			   query, attrs, 0, &result);
-
-	if ((rv != LDAP_SUCCESS) || !result) {
-		crit(MODPREFIX "%s: query failed for %s", __func__, query);
-		return 0;
-	}
-
-	debug(MODPREFIX "%s: getting first entry for %s=\"%s\"", __func__, key, qKey);
-
-	e = ldap_first_entry(ldap, result);
-	if (!e) {
-		debug(MODPREFIX "%s: got answer, but no first entry for %s", __func__, query);
-		ldap_msgfree(result);
-		return CHE_MISSING;
-	}
-
-	debug(MODPREFIX "%s: examining first entry", __func__);
+	if (wild_ret)
+		*wild_ret = CHE_MISSING;
 
-	values = ldap_get_values(ldap, e, type);
-	if (!values) {
-		debug(MODPREFIX "%s: no %s defined for %s", __func__, type, query);
-		ldap_msgfree(result);
-		return CHE_MISSING;
+	ok = ask_helper(ctxt, qKey, wild_ret != NULL, &kv, &wv);
+	if (ok < 0) {
+		schema = find_schema(ctxt, &rv);
+		if (!schema)
+			return rv == LDAP_SUCCESS ? CHE_MISSING : CHE_FAIL;
+		ok = search_key(ctxt, schema, qKey, wild_ret != NULL, &kv, &wv);
 	}
-
-	/* Compare cache entry against LDAP */
-	for (i = 0; values[i]; i++) {
-		me = cache_lookup("*");
-		while (me && (strcmp(me->mapent, values[i]) != 0))
-			me = cache_lookup_next(me);
-		if (!me)
-			break;
+	if (!ok)
+		return CHE_FAIL;
+
+	if (kv)
+		ret = update_key(root, qKey, kv, age);
+	else {
+		debug(MODPREFIX "%s: got answer, but no entry for \"%s\"",
+		      __func__, qKey);
+		ret = CHE_MISSING;
 	}
 
-	if (!me) {
-		cache_delete(root, "*", 0);
-
-		for (i = 0; values[i]; i++) {	
-			rv = cache_add(root, "*", values[i], age);
-			if (!rv)
-				return 0;
-		}
-
-		ret = CHE_UPDATED;
+	if (wild_ret) {
+		if (ret != CHE_MISSING)
+			*wild_ret = CHE_OK;
+		else if (wv)
+			*wild_ret = update_key(root, "*", wv, age);
 	}
 
-	/* Clean up. */
-	ldap_value_free(values);
-	ldap_msgfree(result);
-
-	return ret;
-}
-
+	values_free(kv);
+	values_free(wv);
 
-static int lookup_wild(LDAP *ldap, const char *root,
-		       struct lookup_context *ctxt)
-{
-	int ret, i;
-
-	if (ctxt->schema)
-		return lookup_wild_schema(ldap, root, ctxt->schema, ctxt);
-
-
-	for (i = 0; i < NR_SCHEMAS; i++) {
-		ret = lookup_wild_schema(ldap, root,
-					 &supported_schemas[i], ctxt);
-		if (ret != CHE_FAIL) {
-			set_schema(ctxt, &supported_schemas[i]);
-			break;
-		}
-	}
+	debug(MODPREFIX "%s: %s returns %d", __func__, qKey, ret);
 
 	return ret;
 }
@@ -683,7 +1735,6 @@ static int lookup_wild(LDAP *ldap, const char *root,
 int lookup_mount(const char *root, const char *name, int name_len, void *context)
 {
 	struct lookup_context *ctxt = (struct lookup_context *) context;
-	LDAP *ldap;
 	int ret;
 	char key[KEY_MAX_LEN + 1];
 	int key_len;
@@ -693,6 +1744,7 @@ int lookup_mount(const char *root, const char *name, int name_len, void *context
 	time_t now = time(NULL);
 	time_t t_last_read;
 	int need_hup = 0;
+	int wild_ret = CHE_MISSING;
 
 	if (ap.type == LKP_DIRECT)
 		key_len = snprintf(key, KEY_MAX_LEN, "%s/%s", root, name);
@@ -702,17 +1754,11 @@ int lookup_mount(const char *root, const char *name, int name_len, void *context
 	if (key_len > KEY_MAX_LEN)
 		return 1;
 
-
-	/* Initialize the LDAP context. */
-	ldap = do_connect(ctxt, NULL);
-	if (!ldap)
-		return 0;
-	
-	ret = lookup_one(ldap, root, key, ctxt);
-	if (ret == CHE_FAIL) {
-		ldap_unbind(ldap);
+	/* The wild card map entry comes with the key */
+	ret = lookup_one(root, key,
+			 ap.type == LKP_INDIRECT ? &wild_ret : NULL, ctxt);
+	if (ret == CHE_FAIL)
 		return 1;
-	}
 
 	me = cache_lookup_first();
 	t_last_read = me ? now - me->age : ap.exp_runfreq + 1;
@@ -727,7 +1773,7 @@ int lookup_mount(const char *root, const char *name, int name_len, void *context
 
 		/* Maybe update wild card map entry */
 		if (ap.type == LKP_INDIRECT) {
-			ret = lookup_wild(ldap, root, ctxt);
+			ret = wild_ret;
 			wild = (ret & (CHE_MISSING | CHE_FAIL));
 
 			if (ret & CHE_MISSING)
@@ -737,7 +1783,6 @@ int lookup_mount(const char *root, const char *name, int name_len, void *context
 		if (cache_delete(root, key, 0) && wild)
 			rmdir_path(key);
 	}
-	ldap_unbind(ldap);
 
 	me = cache_lookup(key);
 	if (me) {
@@ -786,6 +1831,11 @@ int lookup_done(void *context)
 {
 	struct lookup_context *ctxt = (struct lookup_context *) context;
 	int rv = close_parse(ctxt->parse);
+	if (ctxt->helper_pid > 0) {
+		kill(ctxt->helper_pid, SIGTERM);
+		close(ctxt->helper_fd);
+	}
+	conn_put(ctxt);
 	free(ctxt->server);
 	free(ctxt->base);
 	free(ctxt);
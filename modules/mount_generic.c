@@ -87,7 +87,6 @@ int mount_mount(const char *root, const char *name, int name_len,
 			     PATH_MOUNT, PATH_MOUNT, "-t", fstype,
 			     what, fullpath, NULL);
 	}
-	unlink(AUTOFS_LOCK);
 
 	if (err) {
 		if ((!ap.ghost && name_len) || !existed)
@@ -31,6 +31,7 @@
 #include <netinet/in.h>
 #include <linux/nfs.h>
 #include <linux/nfs2.h>
+#include <linux/nfs3.h>
 #include <ctype.h>
 
 #define MODULE_MOUNT
@@ -38,28 +39,15 @@
 
 #define MODPREFIX "mount(nfs): "
 
-int mount_version = AUTOFS_MOUNT_VERSION;	/* Required by protocol */
+/* Room for ",vers=N,proto=xxx,port=NNNNN" */
+#define MOUNT_HINTS_LEN	40
 
-static int udpproto;
-static short port_discard;
+int mount_version = AUTOFS_MOUNT_VERSION;	/* Required by protocol */
 
 static struct mount_mod *mount_bind = NULL;
 
 int mount_init(void **context)
 {
-	struct protoent *udp;
-	struct servent *port_dis;
-
-	/* These are context independent */
-	udp = getprotobyname("udp");
-	udpproto = udp ? udp->p_proto : 0;
-	port_dis = getservbyname("discard", "udp");
-
-	if (port_dis)
-		port_discard = port_dis->s_port;
-	else
-		port_discard = htons(9);	/* 9 is the standard discard port */
-
 	/* Make sure we have the local mount method available */
 	if (!mount_bind)
 		mount_bind = open_mount("bind", MODPREFIX);
@@ -67,46 +55,6 @@ int mount_init(void **context)
 	return !mount_bind;
 }
 
-int is_local_addr(const char *host, const char *host_addr, int addr_len)
-{
-	struct sockaddr_in src_addr, local_addr;
-	int src_len = sizeof(src_addr);
-	socklen_t local_len = sizeof(local_addr);
-	int sock, ret;
-
-	sock = socket(AF_INET, SOCK_DGRAM, udpproto);
-	if (sock < 0) {
-		error(MODPREFIX "socket creation failed: %m");
-		return -1;
-	}
-
-	src_addr.sin_family = AF_INET;
-	memcpy(&src_addr.sin_addr, host_addr, addr_len);
-	src_addr.sin_port = port_discard;
-
-	ret = connect(sock, (struct sockaddr *) &src_addr, src_len);
-	if (ret < 0 ) {
-		error(MODPREFIX "connect failed for %s: %m", host);
-		close(sock);
-		return 0;
-	}
-
-	ret = getsockname(sock, (struct sockaddr *) &local_addr, &local_len);
-	if (ret < 0) {
-		error(MODPREFIX "getsockname failed: %m");
-		close(sock);
-		return 0;
-	}
-
-	close(sock);
-
-	ret = memcmp(&src_addr.sin_addr, &local_addr.sin_addr, addr_len);
-	if (ret)
-		return 0;
-	
-	return 1;
-}
-
 /*
  *  Check to see if the 'host:path' or 'host' is on the local machine
  *  Returns < 0 if there is a host lookup problem, otherwise returns 0
@@ -114,12 +62,10 @@ int is_local_addr(const char *host, const char *host_addr, int addr_len)
  */
 int is_local_mount(const char *hostpath)
 {
-	struct hostent *he;
-	char **haddr;
 	char *delim;
 	char *hostname;
 	int hostnamelen;
-	int local = 0;
+	int prox;
 
 	debug(MODPREFIX "is_local_mount: %s", hostpath);
 	delim = strpbrk(hostpath,":");
@@ -129,114 +75,63 @@ int is_local_mount(const char *hostpath)
 	else 
 		hostnamelen = strlen(hostpath);
 
-	hostname = malloc(hostnamelen+1);
+	hostname = alloca(hostnamelen+1);
 	strncpy(hostname,hostpath,hostnamelen);
 	hostname[hostnamelen] = '\0';
-	he = gethostbyname(hostname);
-	if (!he) {
+
+	prox = replicated_proximity(hostname);
+	if (prox < 0) {
 		error(MODPREFIX "host %s: lookup failure", hostname);
 		return -1;
 	}
-
-	for (haddr = he->h_addr_list; *haddr; haddr++) {
-		local = is_local_addr(hostname, *haddr, he->h_length);
-		if (local < 0) 
-			return local;
- 		if (local) {
-			debug(MODPREFIX "host %s: is localhost",
-					hostname);
-			return local;
-		}
+	if (prox == PROXIMITY_LOCAL) {
+		debug(MODPREFIX "host %s: is localhost", hostname);
+		return 1;
 	}
 	return 0;
 }
 
 /*
- * Given a mount string, return (in the same string) the
- * best mount to use based on locality/weight/rpctime.
- *
- * If longtimeout is set to 0 then we only do 100 ms pings to hosts.  In
- * the event that this fails, we call ourself recursively with the
- * longtimeout option set to 1.  In this case we ping for up to 10s and
- * skip logic for detecting if a localhost has been passed. (if a local
- * host had been passed, we would have returned that mount as the best
- * mount.  The skipping of local maps in this case is an optimization).
- *
- * - return -1 and what = '\0' on error,
- *           1 and what = local mount path if local bind,
- *     else  0 and what = remote mount path
+ * The replicas of a mount. They are kept, in the order they were
+ * ranked, so that when a mount from one fails the next can be tried.
+ * The buffers are the caller's, the strings as long as the location
+ * and the hosts sized with replicas_size().
  */
-int get_best_mount(char *what, const char *original, int longtimeout)
+struct replicas {
+	char *buf;			/* Copy of the location, cut up */
+	char *paths;			/* Another, cut up at white space */
+	struct rpc_probe *hosts;
+	int count;			/* Hosts not yet given up on */
+	int ranked;			/* How many at the front are in order */
+};
+
+/* Can't be more hosts than every other character */
+#define replicas_size(loc)	((strlen(loc) / 2 + 1) * sizeof(struct rpc_probe))
+
+/* Split a location up into its hosts and their weights */
+static int parse_replicas(char *p, struct rpc_probe *hosts)
 {
-	char *p = what;
-	char *winner = NULL;
-	int winner_weight = INT_MAX, local = 0;
-	double winner_time = 0;
-	char *delim, *pstrip;
-	int sec = (longtimeout) ? 10 : 0;
-	int micros = (longtimeout) ? 0 : 100000;
-	int skiplocal = longtimeout; /* clearly local is not available */
-
-	if (!p) {
-		*what = '\0';
-		return -1;
-	}
-
-	/*
-	 *  If only one mountpoint has been passed in, we don't need to
-	 *  do anything except strip whitespace from the end of the string.
-	 */
-	if (!strchr(p, ',') && (strchr(p,':') == strrchr(p,':'))) {
-		for (pstrip = p+strlen(p) - 1; pstrip >= p; pstrip--) {
-			if (!isspace(*pstrip))
-				break;
-			*pstrip = '\0';
-		}
-
-		/* Check if the host is the localhost */
-		if (is_local_mount(p) > 0) {
-			debug(MODPREFIX "host %s: is localhost", p);
-
-			/* Strip off hostname and ':' */
-			delim = strchr(p,':');
-			while (delim && *delim != '\0') {
-				delim++;
-				*what = *delim;
-				what++;
-			}
-			return 1;
-		}
-		return 0;
-	}
+	char *delim;
+	int count = 0;
 
 	while (p && *p) {
 		char *next;
-		unsigned int ping_stat = 0;
+		int weight = INT_MAX;
 
 		p += strspn(p, " \t,");
 		delim = strpbrk(p, "(, \t:");
 		if (!delim)
 			break;
 
-		/* Find lowest weight whose server is alive */
 		if (*delim == '(') {
-			char *weight = delim + 1;
-			unsigned int alive;
+			char *w = delim + 1;
 
 			*delim = '\0';
 
-			delim = strchr(weight, ')');
+			delim = strchr(w, ')');
 			if (delim) {
-				int w;
-
 				*delim = '\0';
-				w = atoi(weight);
-
-				alive = rpc_ping(p, sec, micros);
-				if (w < winner_weight && alive) {
-					winner_weight = w;
-					winner = p;
-				}
+				weight = atoi(w);
 			}
 			delim++;
 		}
@@ -262,100 +157,47 @@ int get_best_mount(char *what, const char *original, int longtimeout)
 			break;
 
 		/* p points to a server, "next is our next parse point */
-		if (!skiplocal) {
-			/* Check if it's localhost */
-			local = is_local_mount(p);
-			if (local < 0) {
-				local = 0;
-				p = next;
-				continue;
-			}
+		hosts[count].host = p;
+		hosts[count].weight = weight;
+		count++;
 
-			if (local) {
-				winner = p;
-				break;
-			}
-		}
+		p = next;
+	}
 
-		/* ping each (or the) entry to see if it's alive. */
-		ping_stat = rpc_ping(p, sec, micros);
-		if (!ping_stat) {
-			p = next;
-			continue;
-		}
+	return count;
+}
 
-		/* First unweighted or only host is alive so set winner */
-		if (!winner) {
-			winner = p;
-			/* No more to check, return it */
-			if (!next || !*next)
-				break;
-		}
+static int replica_policy(void)
+{
+	if (ap.hash_multimount)
+		return REPLICA_HASH;
+	if (ap.random_multimount)
+		return REPLICA_RANDOM;
+	return REPLICA_BEST;
+}
 
-		/* Multiple entries and no weighted hosts so compare times */
-		if (winner_weight == INT_MAX) {
-			int status;
-			double resp_time;
-			unsigned int vers = NFS2_VERSION;
-			unsigned int proto = RPC_PING_UDP;
-
-			if (ap.random_multimount) {
-				resp_time = random();
-				if (winner_time == 0 ||
-				    resp_time < winner_time) {
-					winner_time = resp_time;
-					winner = p;
-				}
-				p = next;
-				continue;
-			}
+/*
+ * Put the first of the ranked replicas in what, ranking those left
+ * first if need be.
+ */
+static int elect_replica(char *what, const char *original,
+			 int longtimeout, struct replicas *rep)
+{
+	const char *winner = NULL, *p;
+	char *delim;
+	int local = 0;
 
-			if (ping_stat) {
-				vers = ping_stat & 0x00ff;
-				proto = ping_stat & 0xff00;
-			}
+	if (!rep->ranked && rep->count)
+		rep->ranked = replicated_rank(rep->hosts, rep->count,
+					      longtimeout, replica_policy());
 
-			status = rpc_time(p, vers, proto, sec, micros, &resp_time);
-			/* did we time the first winner? */
-			if (winner_time == 0) {
-				if (status) {
-					winner = p;
-					winner_time = resp_time;
-				} else
-					winner_time = 501;
-			} else {
-				if ((status) && (resp_time < winner_time)) {
-					winner = p;
-					winner_time = resp_time;
-				}
-			}
-		}
-		p = next;
+	if (rep->ranked) {
+		winner = rep->hosts[0].host;
+		local = rep->hosts[0].proximity == PROXIMITY_LOCAL;
 	}
 
-	debug(MODPREFIX "winner = %s local = %d", winner, local);
-
-	/*
-	 * We didn't find a weighted winner or local
-	 */
-	if (!local && winner_weight == INT_MAX) {
-		/* We had more than one contender and none responded in time */
-		if (!ap.random_multimount && 
-		    (winner_time == 0 || winner_time > 500)) {
-			/* We've already tried a longer timeout */
-			if (!longtimeout) {
-				/* Reset string and try again */
-				strcpy(what, original);
-
-				debug(MODPREFIX 
-				      "all hosts timed out for '%s', "
-				      "retrying with longer timeout",
-				      original);
-
-				return get_best_mount(what, original, 1);
-			}
-		}
-	}
+	debug(MODPREFIX "winner = %s local = %d",
+	      winner ? winner : "(none)", local);
 
 	/* No winner found so bail */
 	if (!winner) {
@@ -374,8 +216,7 @@ int get_best_mount(char *what, const char *original, int longtimeout)
 	else
 		what[0] = '\0';
 
-	/* We know we're only reading from p, so discard const */
-	p = (char *) original + (winner - what);
+	p = original + (winner - rep->buf);
 	delim = what + strlen(what);
 
 	/* Find the colon (in the original string) */
@@ -395,6 +236,180 @@ int get_best_mount(char *what, const char *original, int longtimeout)
 	return local;
 }
 
+/*
+ * Given a mount string, return (in the same string) the
+ * best mount to use based on locality/weight/rpctime.
+ *
+ * The hosts are ranked by replicated_rank(): only the nearest of
+ * them are probed, all at once, and the lowest weight to answer
+ * wins, or with no weights the first to answer. If rep is given the
+ * ranking is kept there for next_best_mount().
+ *
+ * - return -1 and what = '\0' on error,
+ *           1 and what = local mount path if local bind,
+ *     else  0 and what = remote mount path
+ */
+int get_best_mount(char *what, const char *original,
+		   int longtimeout, struct replicas *rep)
+{
+	char *p = what;
+	char *delim, *pstrip;
+	struct replicas tmp;
+	int i;
+
+	if (!p) {
+		*what = '\0';
+		return -1;
+	}
+
+	if (!rep) {
+		tmp.buf = alloca(strlen(original) + 1);
+		tmp.paths = alloca(strlen(original) + 1);
+		tmp.hosts = alloca(replicas_size(original));
+		rep = &tmp;
+	}
+	rep->count = rep->ranked = 0;
+
+	/*
+	 *  If only one mountpoint has been passed in, we don't need to
+	 *  do anything except strip whitespace from the end of the string.
+	 */
+	if (!strchr(p, ',') && (strchr(p,':') == strrchr(p,':'))) {
+		for (pstrip = p+strlen(p) - 1; pstrip >= p; pstrip--) {
+			if (!isspace(*pstrip))
+				break;
+			*pstrip = '\0';
+		}
+
+		/* Check if the host is the localhost */
+		if (is_local_mount(p) > 0) {
+			debug(MODPREFIX "host %s: is localhost", p);
+
+			/* Strip off hostname and ':' */
+			delim = strchr(p,':');
+			while (delim && *delim != '\0') {
+				delim++;
+				*what = *delim;
+				what++;
+			}
+			return 1;
+		}
+		return 0;
+	}
+
+	strcpy(rep->buf, original);
+	rep->count = parse_replicas(rep->buf, rep->hosts);
+
+	/* Each host's path, for hashing */
+	for (pstrip = strcpy(rep->paths, original); *pstrip; pstrip++)
+		if (*pstrip == ' ' || *pstrip == '\t')
+			*pstrip = '\0';
+	for (i = 0; i < rep->count; i++) {
+		delim = strchr(original + (rep->hosts[i].host - rep->buf), ':');
+		rep->hosts[i].path = delim ?
+			rep->paths + (delim - original) + 1 : NULL;
+	}
+
+	return elect_replica(what, original, longtimeout, rep);
+}
+
+/*
+ * The replica get_best_mount() put in what failed us, give up on it
+ * and put the next best there instead. Those that were ranked behind
+ * it go in that order; once they are used up the rest are ranked
+ * again, which may mean probing further out. Returns -1, leaving what
+ * alone, if there is nobody else to try.
+ */
+int next_best_mount(char *what, const char *original, struct replicas *rep)
+{
+	char *next;
+	int local;
+
+	if (rep->count < 2)
+		return -1;
+
+	rep->count--;
+	rep->ranked--;
+	memmove(&rep->hosts[0], &rep->hosts[1],
+		rep->count * sizeof(struct rpc_probe));
+
+	next = alloca(strlen(original) + 1);
+	local = elect_replica(next, original, 0, rep);
+	if (!*next) {
+		rep->count = 0;
+		return -1;
+	}
+	strcpy(what, next);
+
+	return local;
+}
+
+/* The server of a host:path, into a buffer at least as long */
+static void mount_server(char *server, const char *whatstr)
+{
+	char *colon;
+
+	strcpy(server, whatstr);
+	colon = strchr(server, ':');
+	if (colon)
+		*colon = '\0';
+}
+
+/* Is name one of the options, either alone or as name=value? */
+static int has_option(const char *options, const char *name)
+{
+	int len = strlen(name);
+	const char *p = options;
+
+	while (p && *p) {
+		p += strspn(p, ", \t");
+		if (!strncmp(p, name, len) &&
+		    (p[len] == '\0' || p[len] == ',' || p[len] == '='))
+			return 1;
+		p = strchr(p, ',');
+	}
+	return 0;
+}
+
+/*
+ * The version and transport server last answered on, and the port if
+ * we know it, as mount options on the end of options so that mount(8)
+ * needn't find them out again. For v4 that means it won't go near
+ * the portmapper or mountd at all. Returns options alone if there is
+ * nothing to add, or the map entry already says.
+ */
+static const char *mount_hints(char *buf, const char *options,
+			       const char *server, unsigned int status)
+{
+	static const char *no_hint[] = {
+		"vers", "nfsvers", "v2", "v3", "v4", "proto", "udp", "tcp", NULL
+	};
+	unsigned int vers = status & 0xff, proto = status & 0xff00;
+	unsigned short port;
+	int len, i;
+
+	if (vers != RPC_PING_V2 && vers != RPC_PING_V3 && vers != RPC_PING_V4)
+		return options;
+
+	for (i = 0; no_hint[i]; i++)
+		if (has_option(options, no_hint[i]))
+			return options;
+
+	if (!options)
+		options = "";
+	len = strlen(options);
+
+	sprintf(buf, "%s%svers=%u,proto=%s", options,
+		len && options[len - 1] != ',' ? "," : "",
+		vers, proto == RPC_PING_TCP ? "tcp" : "udp");
+
+	port = server_port(server, vers, proto);
+	if (port && !has_option(options, "port"))
+		sprintf(buf + strlen(buf), ",port=%u", port);
+
+	return buf;
+}
+
 void seed_random(void)
 {
 	int fd, ret;
@@ -427,6 +442,22 @@ void seed_random(void)
  */
 extern int found_retryable_error;
 
+/* Likewise, set when mount(8) says the vers/proto/port hints were wrong */
+extern int found_hint_error;
+
+/* Local host -- do a "bind" */
+static int mount_local(const char *root, const char *name, int name_len,
+		       const char *path, int ro)
+{
+	const char *bind_options = ro ? "ro" : "";
+
+	debug(MODPREFIX "%s is local, doing bind", name);
+
+	return mount_bind->mount_mount(root, name, name_len,
+				       path, "bind", bind_options,
+				       mount_bind->context);
+}
+
 
 int mount_mount(const char *root, const char *name, int name_len,
 		const char *what, const char *fstype, const char *options,
@@ -439,6 +470,11 @@ int mount_mount(const char *root, const char *name, int name_len,
 	int nosymlink = 0;
 	int ro = 0;            /* Set if mount bind should be read-only */
 	int mount_attempts = 0; 
+	int retries = 0;
+	char *server, *hinted;
+	unsigned int hints;
+	int no_hints = 0;
+	struct replicas rep;
 
 	debug(MODPREFIX "root=%s name=%s what=%s, fstype=%s, options=%s",
 	      root, name, what, fstype, options);
@@ -510,13 +546,17 @@ int mount_mount(const char *root, const char *name, int name_len,
 	}
 
 	local = 0;
+	rep.buf = alloca(strlen(what) + 1);
+	rep.paths = alloca(strlen(what) + 1);
+	rep.hosts = alloca(replicas_size(what));
+	rep.count = rep.ranked = 0;
 
 	colon = strchr(whatstr, ':');
 	if (!colon) {
 		/* No colon, take this as a bind (local) entry */
 		local = 1;
 	} else if (!nosymlink) {
-		local = get_best_mount(whatstr, what, 0);
+		local = get_best_mount(whatstr, what, 0, &rep);
 		if (!*whatstr) {
 			warn(MODPREFIX "no host elected");
 			return 1;
@@ -536,15 +576,7 @@ int mount_mount(const char *root, const char *name, int name_len,
 		sprintf(fullpath, "%s", root);
 
 	if (local) {
-		/* Local host -- do a "bind" */
-
-		const char *bind_options = ro ? "ro" : "";
-
-		debug(MODPREFIX "%s is local, doing bind", name);
-
-		return mount_bind->mount_mount(root, name, name_len,
-					       whatstr, "bind", bind_options,
-					       mount_bind->context);
+		return mount_local(root, name, name_len, whatstr, ro);
 	} else {
 		/* Not a local host - do an NFS mount */
 		int status, existed = 1;
@@ -566,17 +598,44 @@ int mount_mount(const char *root, const char *name, int name_len,
 			return 0;
 		}
 
-		/*  Retry the mount if the error is retryable and the max_nfs-mount_retries > 0 . */
+		/*
+		 * If the mount fails, go straight on to the next replica if
+		 * there is one. Otherwise retry the mount if the error is
+		 * retryable and the max_nfs-mount_retries > 0, backing off
+		 * as the server table says. Each wait is at most
+		 * nfs_mount_retry_pause + 1 seconds, none with a pause of 0.
+		 */
 		mount_attempts = 0;
+		server = alloca(strlen(what) + 1);
+		hinted = alloca((nfsoptions ? strlen(nfsoptions) : 0) +
+				MOUNT_HINTS_LEN);
+
+		for (;;) {
+			const char *options = nfsoptions;
+
+			mount_server(server, whatstr);
+
+			/* What the server answered on, unless that failed */
+			hints = 0;
+			if (!no_hints) {
+				hints = rep.count ? rep.hosts[0].status :
+					server_status(server);
+				options = mount_hints(hinted, nfsoptions,
+						      server, hints);
+				if (options == nfsoptions)
+					hints = 0;
+			}
 
-		do {
-			if (nfsoptions && *nfsoptions) {
+			/* Queue behind other mounts from the same server */
+			server_mount_begin(server);
+
+			if (options && *options) {
 				debug(MODPREFIX "calling mount -t nfs " SLOPPY 
-				      " -o %s %s %s", nfsoptions, whatstr, fullpath);
+				      " -o %s %s %s", options, whatstr, fullpath);
 
 				err = spawnll(LOG_NOTICE,
 					      PATH_MOUNT, PATH_MOUNT, "-t",
-					      "nfs", SLOPPYOPT "-o", nfsoptions,
+					      "nfs", SLOPPYOPT "-o", options,
 					      whatstr, fullpath, NULL);
 			} else {
 				debug(MODPREFIX "calling mount -t nfs %s %s",
@@ -585,48 +644,81 @@ int mount_mount(const char *root, const char *name, int name_len,
 					      PATH_MOUNT, PATH_MOUNT, "-t",
 					      "nfs", whatstr, fullpath, NULL);
 			}
+			server_mount_end();
 			mount_attempts++;
-			if (err) {
-
-				/*
-				 * found_retryable_error is set in spawn.c - I kid you not. It's the least invasive hack bryder could make 
-				 * since the error message from a failed mount is not passed back. 
-				 * The flag is true of one of a set of retryable error messages were seen.
-				 */
-				if (found_retryable_error && (mount_attempts <= ap.max_nfs_mount_retries)){
-					error(MODPREFIX "nfs: mount failure %s on %s - trying %d more times", whatstr, fullpath, (ap.max_nfs_mount_retries - mount_attempts)+1);
-					if (ap.nfs_mount_retry_pause > 0 ){
-						int fd = open("/dev/urandom", O_RDONLY);
-						if (fd < 0) {
-							srand(time(NULL));
-						} 
-						else  {
-							unsigned int seed;
-							read(fd, &seed, sizeof(seed));
-							srand(seed);
-							close(fd);
-						}
-
-						/* Randomise the sleep time  - between 1s and the max (+1s)*/
-						useconds_t sleep_usecs = 1000000 + (int)(((float)ap.nfs_mount_retry_pause * 1000000 ) * (((float)rand() / (float)RAND_MAX)));
-						debug(MODPREFIX "nfs: mount failed - sleeping %d microsecs before retry",(unsigned int)sleep_usecs); 
-						usleep(sleep_usecs);
-					}
-					continue; 
-				} else {
-					if ((!ap.ghost && name_len) || !existed)
+			if (!err) {
+				server_mount_ok(server);
+				break; /* good mount - get out of the loop and return */
+			}
+
+			/*
+			 * Maybe what we told mount(8) is out of date. Not
+			 * if it hung, that is the server, not the hints.
+			 */
+			if (hints && found_hint_error) {
+				server_set_port(server, hints & 0xff,
+						hints & 0xff00, 0);
+				debug(MODPREFIX "nfs: mount failed with "
+				      "hints, trying %s without", whatstr);
+				no_hints = 1;
+				continue;
+			}
+
+			if (rep.count > 1) {
+				const char *failed = rep.hosts[0].host;
+
+				/* So that other mounts pass it by for a while */
+				server_failed(failed);
+
+				no_hints = 0;
+				local = next_best_mount(whatstr, what, &rep);
+				if (local == 1) {
+					error(MODPREFIX "nfs: mount failure "
+					      "from %s on %s - binding local %s",
+					      failed, fullpath, whatstr);
+					err = mount_local(root, name, name_len,
+							  whatstr, ro);
+					if (err && ((!ap.ghost && name_len) ||
+						    !existed))
 						rmdir_path(name);
+					return err;
+				}
+				if (local == 0) {
+					error(MODPREFIX "nfs: mount failure "
+					      "from %s on %s - trying %s",
+					      failed, fullpath, whatstr);
+					continue;
+				}
+			}
 
-					error(MODPREFIX "nfs: mount failure %s on %s",
-					      whatstr, fullpath);
-					return 1;
+			/*
+			 * found_retryable_error is set in spawn.c - I kid you not. It's the least invasive hack bryder could make 
+			 * since the error message from a failed mount is not passed back. 
+			 * The flag is true of one of a set of retryable error messages were seen.
+			 */
+			if (found_retryable_error && (retries++ < ap.max_nfs_mount_retries)){
+				long wait = 0;
+
+				if (ap.nfs_mount_retry_pause)
+					wait = server_backoff(server,
+						(ap.nfs_mount_retry_pause + 1) * 1000);
+
+				error(MODPREFIX "nfs: mount failure %s on %s - trying %d more times", whatstr, fullpath, (ap.max_nfs_mount_retries - retries)+1);
+				if (wait) {
+					debug(MODPREFIX "nfs: mount failed - sleeping %ld ms before retry", wait);
+					usleep(wait * 1000);
 				}
-			} else {
-				break; /* good mount - get out of the loop and return */
+				continue; 
 			}
-		} while (mount_attempts <= ap.max_nfs_mount_retries ); /* loop is also exited via a couple of breaks  and returns */
 
-			
+			if ((!ap.ghost && name_len) || !existed)
+				rmdir_path(name);
+
+			error(MODPREFIX "nfs: mount failure %s on %s",
+			      whatstr, fullpath);
+			return 1;
+		}
+
 		debug(MODPREFIX "%s: mounted %s on %s after %d attempts", __func__, whatstr, fullpath, mount_attempts );
 		return 0;
 	}